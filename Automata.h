@@ -0,0 +1,229 @@
+// Automaton algorithms shared by mylexer and NFA2DFA, so both programs build
+// and minimize DFAs with the same code.
+#ifndef AUTOMATA_H
+#define AUTOMATA_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <utility>
+#include <vector>
+
+// Epsilon closures of every state of an NFA with states 0..n-1, computed
+// once. Tarjan's algorithm finds the strongly connected components of the
+// epsilon edges: all states of a component share one closure, and components
+// are completed in reverse topological order, so a component's closure is its
+// own states plus the closures of the components its edges lead to, all
+// computed already. A closure is a sparse bitset, (word, bits) pairs in word
+// order; the closure of a set of states is the OR of its states' closures.
+//
+// The epsilon edges are read through graph, which has
+//   Cursor First(int state) const                 first edge of state
+//   bool Next(int state, Cursor &edge, int &to) const
+//       the target of the next epsilon edge from edge on, moving edge past
+//       it; false when there is none
+class EpsilonClosures {
+public:
+    template <typename Graph>
+    EpsilonClosures(int n, const Graph &graph) : words((n + 63) / 64) {
+        using Cursor = typename Graph::Cursor;
+        component.assign(n, -1);
+        std::vector<int> index(n, -1), low(n);
+        std::vector<int> open; // states of components not yet completed
+        std::vector<std::pair<int, Cursor>> frames; // state, next edge to look at
+        std::vector<int> seen; // last component that merged each component
+        int counter = 0;
+        for (int root = 0; root < n; root++) {
+            if (index[root] >= 0) continue;
+            index[root] = low[root] = counter++;
+            open.push_back(root);
+            frames.push_back({root, graph.First(root)});
+            while (!frames.empty()) {
+                int state = frames.back().first;
+                int to;
+                if (graph.Next(state, frames.back().second, to)) {
+                    if (index[to] < 0) {
+                        index[to] = low[to] = counter++;
+                        open.push_back(to);
+                        frames.push_back({to, graph.First(to)});
+                    } else if (component[to] < 0) {
+                        low[state] = std::min(low[state], index[to]);
+                    }
+                    continue;
+                }
+                frames.pop_back();
+                if (!frames.empty()) {
+                    int parent = frames.back().first;
+                    low[parent] = std::min(low[parent], low[state]);
+                }
+                if (low[state] != index[state]) continue;
+
+                // state is the root of a component: everything above it on open
+                int id = (int)closures.size();
+                std::vector<std::pair<uint32_t, uint64_t>> bits;
+                size_t first = open.size();
+                do {
+                    first--;
+                    component[open[first]] = id;
+                    bits.push_back({(uint32_t)(open[first] / 64), uint64_t(1) << (open[first] % 64)});
+                } while (open[first] != state);
+                seen.push_back(id);
+                for (size_t i = first; i < open.size(); i++) {
+                    Cursor edge = graph.First(open[i]);
+                    int next;
+                    while (graph.Next(open[i], edge, next)) {
+                        int other = component[next];
+                        if (seen[other] == id) continue;
+                        seen[other] = id;
+                        bits.insert(bits.end(), closures[other].begin(), closures[other].end());
+                    }
+                }
+                open.resize(first);
+
+                // Sort by word and combine the bits of equal words
+                std::sort(bits.begin(), bits.end());
+                size_t out = 0;
+                for (size_t i = 0; i < bits.size(); i++) {
+                    if (out > 0 && bits[out - 1].first == bits[i].first) {
+                        bits[out - 1].second |= bits[i].second;
+                    } else {
+                        bits[out++] = bits[i];
+                    }
+                }
+                bits.resize(out);
+                bits.shrink_to_fit();
+                closures.push_back(std::move(bits));
+            }
+        }
+    }
+
+    // 64-bit words in a bitset of states
+    size_t Words() const {
+        return words;
+    }
+
+    // Add the closure of state to the bitset set, unless state is in it
+    // already: then so is its closure, if set was built from closures
+    void AddTo(int state, uint64_t *set) const {
+        if (set[state / 64] >> (state % 64) & 1) return;
+        for (const auto &[word, bits] : closures[component[state]]) {
+            set[word] |= bits;
+        }
+    }
+
+private:
+    size_t words = 0;
+    std::vector<int> component; // component of each state
+    std::vector<std::vector<std::pair<uint32_t, uint64_t>>> closures; // closure of each component
+};
+
+// Hopcroft's partition refinement on a complete DFA with states 0..n-1 and k
+// input classes; next(state, a) is the target of state on class a. States
+// start out grouped by label (what they accept), so states with different
+// labels are never merged. Returns the block of each state: two states share
+// a block exactly when they are equivalent. Runs in O(n k log n).
+template <typename Next>
+std::vector<int> HopcroftBlocks(int n, int k, Next next, const std::vector<int> &label) {
+    // Inverse transitions: sources of (class, target), stored contiguously
+    std::vector<int> invStart((size_t)k * n + 1, 0);
+    std::vector<int> inv((size_t)k * n);
+    for (int state = 0; state < n; state++) {
+        for (int a = 0; a < k; a++) {
+            invStart[(size_t)a * n + next(state, a) + 1]++;
+        }
+    }
+    for (size_t i = 1; i < invStart.size(); i++) {
+        invStart[i] += invStart[i - 1];
+    }
+    std::vector<int> fill(invStart.begin(), invStart.end() - 1);
+    for (int state = 0; state < n; state++) {
+        for (int a = 0; a < k; a++) {
+            inv[fill[(size_t)a * n + next(state, a)]++] = state;
+        }
+    }
+
+    // Partition: each block is a contiguous range [first, last) of elems
+    std::vector<int> elems, loc(n), blockOf(n), first, last, marked;
+    std::map<int, std::vector<int>> byLabel;
+    for (int state = 0; state < n; state++) {
+        byLabel[label[state]].push_back(state);
+    }
+    for (const auto &group : byLabel) {
+        first.push_back((int)elems.size());
+        for (int state : group.second) {
+            loc[state] = (int)elems.size();
+            blockOf[state] = (int)first.size() - 1;
+            elems.push_back(state);
+        }
+        last.push_back((int)elems.size());
+        marked.push_back(0);
+    }
+
+    // Every initial block but the largest is a splitter
+    std::vector<int> work;
+    std::vector<bool> inWork(first.size(), false);
+    int largest = 0;
+    for (int b = 1; b < (int)first.size(); b++) {
+        if (last[b] - first[b] > last[largest] - first[largest]) largest = b;
+    }
+    for (int b = 0; b < (int)first.size(); b++) {
+        if (b != largest) {
+            work.push_back(b);
+            inWork[b] = true;
+        }
+    }
+
+    std::vector<int> touched;
+    while (!work.empty()) {
+        int splitter = work.back();
+        work.pop_back();
+        inWork[splitter] = false;
+        std::vector<int> targets(elems.begin() + first[splitter], elems.begin() + last[splitter]);
+
+        for (int a = 0; a < k; a++) {
+            // Move every predecessor to the front of its block
+            for (int target : targets) {
+                size_t slot = (size_t)a * n + target;
+                for (int i = invStart[slot]; i < invStart[slot + 1]; i++) {
+                    int state = inv[i];
+                    int b = blockOf[state];
+                    int m = first[b] + marked[b];
+                    if (loc[state] < m) continue;
+                    int other = elems[m];
+                    std::swap(elems[loc[state]], elems[m]);
+                    loc[other] = loc[state];
+                    loc[state] = m;
+                    if (marked[b]++ == 0) touched.push_back(b);
+                }
+            }
+
+            // Split blocks that were only partly marked
+            for (int b : touched) {
+                if (marked[b] < last[b] - first[b]) {
+                    int nb = (int)first.size();
+                    first.push_back(first[b]);
+                    last.push_back(first[b] + marked[b]);
+                    marked.push_back(0);
+                    inWork.push_back(false);
+                    first[b] += marked[b];
+                    for (int i = first[nb]; i < last[nb]; i++) {
+                        blockOf[elems[i]] = nb;
+                    }
+                    if (inWork[b] || last[nb] - first[nb] <= last[b] - first[b]) {
+                        work.push_back(nb);
+                        inWork[nb] = true;
+                    } else {
+                        work.push_back(b);
+                        inWork[b] = true;
+                    }
+                }
+                marked[b] = 0;
+            }
+            touched.clear();
+        }
+    }
+    return blockOf;
+}
+
+#endif
@@ -2,8 +2,17 @@
 #include <vector>
 #include <set>
 #include <map>
-#include <queue>
 #include <algorithm>
+#include <string>
+#include <cstdint>
+#include <memory>
+#include <tuple>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <cstdlib>
+#include "Automata.h"
 using namespace std;
 
 //--------------------------------------------------------------
@@ -15,6 +24,8 @@ using NFAStates = set<NFAState>; // Set of NFA states
 
 //--------------------------------------------------------------
 // NFA Class
+// The form NFAs are built in; FrozenNFA below is the compact copy the
+// subset construction reads.
 //--------------------------------------------------------------
 class NFA {
 public:
@@ -22,107 +33,646 @@ public:
     NFAState startState; // Start state
     NFAStates acceptStates; // Accept states
     map<NFAState, NFATransition> transitions; // Transition function
+};
 
-    // Compute epsilon-closure of a set of states
-    NFAStates epsilonClosure(const NFAStates& states) {
-        NFAStates closure = states;
-        queue<NFAState> q;
-        for (NFAState state : states) {
-            q.push(state);
-        }
-        while (!q.empty()) {
-            NFAState current = q.front();
-            q.pop();
-            // Add all states reachable via epsilon transitions
-            if (transitions[current].count('\0')) {
-                for (NFAState nextState : transitions[current]['\0']) {
-                    if (closure.find(nextState) == closure.end()) {
-                        closure.insert(nextState);
-                        q.push(nextState);
-                    }
-                }
+//--------------------------------------------------------------
+// Frozen NFA
+// A read-only copy of an NFA in compressed sparse row form, for the
+// subset construction: build the NFA above, then freeze it. States
+// are numbered densely, 0..n-1, in increasing order of their NFA
+// state ids. The labeled edges of state i are
+// edges[edgeStart[i] .. edgeStart[i + 1]), each a byte range and a
+// target, and its epsilon successors are
+// epsilonTargets[epsilonStart[i] .. epsilonStart[i + 1]).
+//--------------------------------------------------------------
+struct LabeledEdge {
+    unsigned char lo; // first symbol of the range
+    unsigned char hi; // last symbol of the range
+    int to; // target state
+};
+
+class FrozenNFA {
+public:
+    vector<NFAState> states; // NFA state id of each state
+    int startState; // Start state
+    vector<bool> accepting; // Accept states
+    vector<uint32_t> edgeStart; // first labeled edge of each state, and the end
+    vector<LabeledEdge> edges; // labeled edges, ordered by state, range and target
+    vector<uint32_t> epsilonStart; // first epsilon successor of each state, and the end
+    vector<int> epsilonTargets; // epsilon successors, ordered by state and target
+
+    explicit FrozenNFA(const NFA& nfa) {
+        // Number the NFA states densely
+        NFAStates all = nfa.states;
+        all.insert(nfa.startState);
+        all.insert(nfa.acceptStates.begin(), nfa.acceptStates.end());
+        for (const auto& [state, transition] : nfa.transitions) {
+            all.insert(state);
+            for (const auto& [symbol, nextStates] : transition) {
+                all.insert(nextStates.begin(), nextStates.end());
             }
         }
-        return closure;
-    }
+        states.assign(all.begin(), all.end());
+        auto indexOf = [&](NFAState state) {
+            return (int)(lower_bound(states.begin(), states.end(), state) - states.begin());
+        };
+        startState = indexOf(nfa.startState);
+        accepting.assign(states.size(), false);
+        for (NFAState state : nfa.acceptStates) {
+            accepting[indexOf(state)] = true;
+        }
 
-    // Compute the set of states reachable from a set of states on a given input symbol
-    NFAStates move(const NFAStates& states, char symbol) {
-        NFAStates result;
+        // Runs of consecutive symbols to the same target become one range
+        vector<pair<int, int>> labels; // (target, symbol)
         for (NFAState state : states) {
-            if (transitions[state].count(symbol)) {
-                for (NFAState nextState : transitions[state][symbol]) {
-                    result.insert(nextState);
+            edgeStart.push_back((uint32_t)edges.size());
+            epsilonStart.push_back((uint32_t)epsilonTargets.size());
+            auto it = nfa.transitions.find(state);
+            if (it == nfa.transitions.end()) continue;
+            labels.clear();
+            for (const auto& [symbol, nextStates] : it->second) {
+                for (NFAState nextState : nextStates) {
+                    if (symbol == '\0') {
+                        epsilonTargets.push_back(indexOf(nextState));
+                    } else {
+                        labels.push_back({indexOf(nextState), (unsigned char)symbol});
+                    }
+                }
+            }
+            sort(epsilonTargets.begin() + epsilonStart.back(), epsilonTargets.end());
+            sort(labels.begin(), labels.end());
+            size_t first = edges.size();
+            for (size_t i = 0; i < labels.size(); i++) {
+                auto [to, symbol] = labels[i];
+                if (edges.size() > first && edges.back().to == to && edges.back().hi + 1 == symbol) {
+                    edges.back().hi = (unsigned char)symbol;
+                } else {
+                    edges.push_back({(unsigned char)symbol, (unsigned char)symbol, to});
                 }
             }
+            sort(edges.begin() + first, edges.end(), [](const LabeledEdge& a, const LabeledEdge& b) {
+                return a.lo != b.lo ? a.lo < b.lo : a.to < b.to;
+            });
         }
-        return result;
+        edgeStart.push_back((uint32_t)edges.size());
+        epsilonStart.push_back((uint32_t)epsilonTargets.size());
+    }
+
+    int size() const {
+        return (int)states.size();
     }
 };
 
 //--------------------------------------------------------------
 // DFA State Representation
+// A DFA state is a set of NFA states, held as a dense bitset over
+// the NFA's states numbered 0..n-1 in increasing order. DFA states
+// are numbered from 0 (the start state) in order of discovery.
 //--------------------------------------------------------------
-using DFAState = set<NFAState>; // DFA state is a set of NFA states
-using DFATransition = map<char, DFAState>; // Transition function for DFA
+using DFAState = int;
 
 //--------------------------------------------------------------
 // DFA Class
 //--------------------------------------------------------------
 class DFA {
 public:
-    set<DFAState> states; // Set of states
-    DFAState startState; // Start state
-    set<DFAState> acceptStates; // Accept states
-    map<DFAState, DFATransition> transitions; // Transition function
+    DFA() {
+        fill(columnOf, columnOf + 256, -1);
+    }
+
+    vector<NFAState> nfaStates; // NFA state of each bit of a state set
+    size_t words = 0; // 64-bit words per state set
+    vector<uint64_t> sets; // NFA state set of each DFA state, words apiece
+    DFAState startState = 0; // Start state
+    vector<bool> accepting; // Accept states
+    vector<string> symbols; // Input symbols of each column of the transition table
+    int columnOf[256]; // Column of each input symbol, -1 for symbols on no edge
+    vector<DFAState> transitions; // Next state per state and column, -1 if none
+
+    int size() const {
+        return (int)accepting.size();
+    }
+
+    DFAState next(DFAState state, int column) const {
+        return transitions[(size_t)state * symbols.size() + column];
+    }
+
+    // The NFA states making up a DFA state
+    NFAStates nfaStatesOf(DFAState state) const {
+        NFAStates members;
+        const uint64_t* set = sets.data() + (size_t)state * words;
+        for (size_t w = 0; w < words; w++) {
+            for (uint64_t bits = set[w]; bits; bits &= bits - 1) {
+                members.insert(nfaStates[w * 64 + __builtin_ctzll(bits)]);
+            }
+        }
+        return members;
+    }
 };
 
 //--------------------------------------------------------------
-// NFA to DFA Conversion using Subset Construction
+// Interned NFA State Sets
+// Every distinct set is stored once, in one flat pool, and gets the
+// next integer id; an open-addressing hash table finds the id of a
+// set. Comparing two sets is a hash compare and, on a hit, a scan of
+// a few words.
+//--------------------------------------------------------------
+class StateSetTable {
+public:
+    explicit StateSetTable(size_t words) : words(words), slots(64, -1) {}
+
+    int size() const {
+        return (int)hashes.size();
+    }
+
+    const uint64_t* get(int id) const {
+        return pool.data() + (size_t)id * words;
+    }
+
+    // Id of set; a set not seen before is added with the next id
+    int intern(const uint64_t* set, bool& added) {
+        uint64_t h = hash(set);
+        size_t mask = slots.size() - 1;
+        for (size_t slot = h & mask; slots[slot] >= 0; slot = (slot + 1) & mask) {
+            int id = slots[slot];
+            if (hashes[id] == h && equal(set, set + words, get(id))) {
+                added = false;
+                return id;
+            }
+        }
+        int id = size();
+        pool.insert(pool.end(), set, set + words);
+        hashes.push_back(h);
+        if (hashes.size() * 2 > slots.size()) {
+            slots.assign(slots.size() * 2, -1);
+            for (int other = 0; other < size(); other++) {
+                place(other);
+            }
+        } else {
+            place(id);
+        }
+        added = true;
+        return id;
+    }
+
+    // Id of set, or -1 if it has not been added
+    int find(const uint64_t* set) const {
+        uint64_t h = hash(set);
+        size_t mask = slots.size() - 1;
+        for (size_t slot = h & mask; slots[slot] >= 0; slot = (slot + 1) & mask) {
+            int id = slots[slot];
+            if (hashes[id] == h && equal(set, set + words, get(id))) {
+                return id;
+            }
+        }
+        return -1;
+    }
+
+    uint64_t hash(const uint64_t* set) const {
+        uint64_t h = 0x9e3779b97f4a7c15ULL;
+        for (size_t w = 0; w < words; w++) {
+            h = (h ^ set[w]) * 0xff51afd7ed558ccdULL;
+            h ^= h >> 32;
+        }
+        return h;
+    }
+
+    // Hand over the pool of sets, in id order
+    vector<uint64_t> release() {
+        return move(pool);
+    }
+
+private:
+    size_t words;
+    vector<uint64_t> pool; // all sets, words apiece
+    vector<uint64_t> hashes; // hash of each set
+    vector<int> slots; // set ids, -1 for an empty slot; a power of two in size
+
+    void place(int id) {
+        size_t mask = slots.size() - 1;
+        size_t slot = hashes[id] & mask;
+        while (slots[slot] >= 0) {
+            slot = (slot + 1) & mask;
+        }
+        slots[slot] = id;
+    }
+};
+
+// Epsilon edges of a frozen NFA, as EpsilonClosures (Automata.h) reads them
+struct FrozenEpsilonEdges {
+    using Cursor = uint32_t; // index into epsilonTargets
+    const FrozenNFA& nfa;
+
+    uint32_t First(int state) const {
+        return nfa.epsilonStart[state];
+    }
+
+    bool Next(int state, uint32_t& edge, int& to) const {
+        if (edge == nfa.epsilonStart[state + 1]) return false;
+        to = nfa.epsilonTargets[edge++];
+        return true;
+    }
+};
+
+//--------------------------------------------------------------
+// Subset Construction Input
+// The successors of each state of a frozen NFA, per byte class, so
+// moves work on bitsets, and the epsilon closure of every state,
+// found up front. The alphabet is every symbol on an edge. Symbols
+// on exactly the same edges form one byte class, and each DFA state
+// is expanded once per class. Fills in the DFA's NFA states and
+// columns.
 //--------------------------------------------------------------
-DFA NFA2DFA(const NFA& nfa) {
+class SubsetNFA {
+public:
+    size_t words; // 64-bit words per state set
+    size_t columns; // byte classes
+    int start; // bit of the start state
+    vector<uint32_t> stepStart; // first step of each state, and the end
+    vector<pair<int, int>> steps; // (column, successor), ordered by state and column
+    vector<uint64_t> acceptBits; // the accept states
+
+    SubsetNFA(const FrozenNFA& nfa, DFA& dfa) : closures(nfa.size(), FrozenEpsilonEdges{nfa}) {
+        int n = nfa.size();
+        dfa.nfaStates = nfa.states;
+        words = dfa.words = (n + 63) / 64;
+        start = nfa.startState;
+
+        // The edges of each symbol, as (from, to) pairs in order
+        vector<vector<pair<int, int>>> edgesOf(256);
+        for (int state = 0; state < n; state++) {
+            for (uint32_t e = nfa.edgeStart[state]; e < nfa.edgeStart[state + 1]; e++) {
+                for (int symbol = nfa.edges[e].lo; symbol <= nfa.edges[e].hi; symbol++) {
+                    edgesOf[symbol].push_back({state, nfa.edges[e].to});
+                }
+            }
+        }
+
+        // Byte classes: one column per distinct set of edges
+        map<vector<pair<int, int>>, int> columnOfEdges;
+        fill(dfa.columnOf, dfa.columnOf + 256, -1);
+        for (int symbol = 1; symbol < 256; symbol++) {
+            vector<pair<int, int>>& edges = edgesOf[symbol];
+            if (edges.empty()) continue;
+            sort(edges.begin(), edges.end());
+            auto it = columnOfEdges.insert({edges, (int)dfa.symbols.size()}).first;
+            if (it->second == (int)dfa.symbols.size()) {
+                dfa.symbols.push_back("");
+            }
+            dfa.symbols[it->second] += (char)symbol;
+            dfa.columnOf[symbol] = it->second;
+        }
+        columns = dfa.symbols.size();
+
+        // Successors of each NFA state on each class
+        vector<vector<pair<int, int>>> stepsOf(n);
+        for (const auto& [edges, column] : columnOfEdges) {
+            for (const auto& [from, to] : edges) {
+                stepsOf[from].push_back({column, to});
+            }
+        }
+        for (int state = 0; state < n; state++) {
+            stepStart.push_back((uint32_t)steps.size());
+            sort(stepsOf[state].begin(), stepsOf[state].end());
+            steps.insert(steps.end(), stepsOf[state].begin(), stepsOf[state].end());
+        }
+        stepStart.push_back((uint32_t)steps.size());
+        acceptBits.assign(words, 0);
+        for (int state = 0; state < n; state++) {
+            if (nfa.accepting[state]) acceptBits[state / 64] |= 1ULL << (state % 64);
+        }
+    }
+
+    // Add the epsilon closure of state to set, unless state is in it
+    // already: then so is its closure, as set is a union of closures
+    void addClosure(int state, uint64_t* set) const {
+        closures.AddTo(state, set);
+    }
+
+    // The epsilon closure of the states reachable from set on column,
+    // into next; false if none are
+    bool move(const uint64_t* set, size_t column, uint64_t* next) const {
+        fill(next, next + words, 0);
+        bool any = false;
+        for (size_t w = 0; w < words; w++) {
+            for (uint64_t bits = set[w]; bits; bits &= bits - 1) {
+                int state = (int)(w * 64 + __builtin_ctzll(bits));
+                uint32_t end = stepStart[state + 1];
+                for (uint32_t s = stepStart[state]; s < end && steps[s].first <= (int)column; s++) {
+                    if (steps[s].first == (int)column) {
+                        addClosure(steps[s].second, next);
+                        any = true;
+                    }
+                }
+            }
+        }
+        return any;
+    }
+
+    bool accepts(const uint64_t* set) const {
+        for (size_t w = 0; w < words; w++) {
+            if (set[w] & acceptBits[w]) return true;
+        }
+        return false;
+    }
+
+private:
+    EpsilonClosures closures; // found up front, by Tarjan's algorithm
+};
+
+//--------------------------------------------------------------
+// Parallel Subset Construction
+// The states found in one round, the frontier, are expanded by jobs
+// threads together: this one and jobs - 1 workers that are started
+// once and woken for each frontier larger than one chunk. A target set not yet numbered goes into one of
+// several locked shards, picked by its hash, along with the first
+// (state, column) position that reached it. Once the frontier is
+// done, the new sets are numbered in order of those positions, which
+// is the order the one-at-a-time queue finds them in, so the DFA is
+// the same whatever the number of jobs.
+//--------------------------------------------------------------
+DFA ParallelNFA2DFA(const FrozenNFA& nfa, int jobs) {
+    const size_t SHARDS = 64;
+    const size_t CHUNK = 16; // frontier states taken by a thread at a time
+
+    struct Shard {
+        mutex lock;
+        StateSetTable sets;
+        vector<size_t> first; // first position reaching each set
+
+        explicit Shard(size_t words) : sets(words) {}
+    };
+
     DFA dfa;
-    // Compute the epsilon-closure of the NFA's start state
-    dfa.startState = nfa.epsilonClosure({nfa.startState});
-    dfa.states.insert(dfa.startState);
+    SubsetNFA input(nfa, dfa);
+    size_t words = input.words;
+    size_t k = input.columns;
+
+    StateSetTable table(words);
+    vector<uint64_t> start(words, 0);
+    input.addClosure(input.start, start.data());
+    bool added;
+    dfa.startState = table.intern(start.data(), added);
+
+    // The frontier being expanded, shared with the workers
+    DFAState levelStart = 0;
+    size_t count = 0;
+    vector<pair<int, int>> found; // target of each (state, column): (shard or -1, id)
+    vector<unique_ptr<Shard>> shards;
+    atomic<size_t> nextChunk(0);
+    auto expand = [&](vector<uint64_t>& next) {
+        for (size_t begin; (begin = nextChunk.fetch_add(CHUNK)) < count;) {
+            for (size_t i = begin; i < min(begin + CHUNK, count); i++) {
+                const uint64_t* set = table.get(levelStart + (int)i);
+                for (size_t a = 0; a < k; a++) {
+                    size_t position = i * k + a;
+                    if (!input.move(set, a, next.data())) {
+                        found[position] = {-1, -1};
+                        continue;
+                    }
+                    int id = table.find(next.data());
+                    if (id >= 0) {
+                        found[position] = {-1, id};
+                        continue;
+                    }
+                    int s = (int)(table.hash(next.data()) >> 58) % SHARDS;
+                    Shard& shard = *shards[s];
+                    lock_guard<mutex> guard(shard.lock);
+                    bool added;
+                    id = shard.sets.intern(next.data(), added);
+                    if (added) {
+                        shard.first.push_back(position);
+                    } else {
+                        shard.first[id] = min(shard.first[id], position);
+                    }
+                    found[position] = {s, id};
+                }
+            }
+        }
+    };
 
-    queue<DFAState> q;
-    q.push(dfa.startState);
+    // jobs - 1 workers, started once and woken for every frontier of more
+    // than one chunk; the last one to run out of chunks wakes this thread
+    mutex lock;
+    condition_variable started, done;
+    uint64_t level = 0; // frontiers handed to the workers so far
+    int busy = 0;       // workers still on the current one
+    bool finished = false;
+    auto worker = [&]() {
+        vector<uint64_t> next(words);
+        for (uint64_t seen = 0;;) {
+            {
+                unique_lock<mutex> guard(lock);
+                started.wait(guard, [&] { return level != seen || finished; });
+                if (level == seen) break;
+                seen = level;
+            }
+            expand(next);
+            lock_guard<mutex> guard(lock);
+            if (--busy == 0) done.notify_one();
+        }
+    };
+    vector<thread> pool;
+    for (int t = 1; t < jobs; t++) {
+        pool.emplace_back(worker);
+    }
 
-    while (!q.empty()) {
-        DFAState currentState = q.front();
-        q.pop();
+    vector<uint64_t> next(words);
+    while (levelStart < table.size()) {
+        DFAState levelEnd = table.size();
+        count = levelEnd - levelStart;
+        found.assign(count * k, {-1, -1});
+        shards.clear();
+        for (size_t s = 0; s < SHARDS; s++) {
+            shards.push_back(make_unique<Shard>(words));
+        }
+        nextChunk = 0;
+        if (count > CHUNK && !pool.empty()) {
+            {
+                lock_guard<mutex> guard(lock);
+                busy = (int)pool.size();
+                level++;
+            }
+            started.notify_all();
+            expand(next);
+            unique_lock<mutex> guard(lock);
+            done.wait(guard, [&] { return busy == 0; });
+        } else {
+            expand(next);
+        }
 
-        // Check if the current state is an accept state
-        for (NFAState state : currentState) {
-            if (nfa.acceptStates.find(state) != nfa.acceptStates.end()) {
-                dfa.acceptStates.insert(currentState);
-                break;
+        // Number the new sets in the order they were first reached
+        vector<tuple<size_t, int, int>> fresh; // first position, shard, id
+        vector<vector<DFAState>> idOf(SHARDS);
+        for (size_t s = 0; s < SHARDS; s++) {
+            for (int id = 0; id < shards[s]->sets.size(); id++) {
+                fresh.emplace_back(shards[s]->first[id], (int)s, id);
             }
+            idOf[s].resize(shards[s]->sets.size());
+        }
+        sort(fresh.begin(), fresh.end());
+        for (const auto& [position, s, id] : fresh) {
+            idOf[s][id] = table.intern(shards[s]->sets.get(id), added);
+        }
+
+        for (DFAState current = levelStart; current < levelEnd; current++) {
+            dfa.accepting.push_back(input.accepts(table.get(current)));
+        }
+        for (const auto& [s, id] : found) {
+            dfa.transitions.push_back(s < 0 ? id : idOf[s][id]);
         }
+        levelStart = levelEnd;
+    }
+
+    {
+        lock_guard<mutex> guard(lock);
+        finished = true;
+    }
+    started.notify_all();
+    for (thread& t : pool) {
+        t.join();
+    }
+    dfa.sets = table.release();
+    return dfa;
+}
+
+//--------------------------------------------------------------
+// NFA to DFA Conversion using Subset Construction
+// State sets are interned as they are found; since ids are handed
+// out in discovery order, the ids themselves are the queue. With
+// more than one job the construction runs a frontier at a time
+// instead, to the same result.
+//--------------------------------------------------------------
+DFA NFA2DFA(const FrozenNFA& nfa, int jobs = 1) {
+    if (jobs > 1) {
+        return ParallelNFA2DFA(nfa, jobs);
+    }
+    DFA dfa;
+    SubsetNFA input(nfa, dfa);
+    size_t words = input.words;
+    size_t k = input.columns;
+
+    StateSetTable table(words);
+    vector<uint64_t> next(words, 0);
+    input.addClosure(input.start, next.data());
+    bool added;
+    dfa.startState = table.intern(next.data(), added);
+
+    for (DFAState current = 0; current < table.size(); current++) {
+        // Check if the current state is an accept state
+        dfa.accepting.push_back(input.accepts(table.get(current)));
 
         // Compute transitions for each input symbol
-        for (char symbol : {'a', 'b'}) { // Assuming alphabet is {a, b}
-            NFAStates nextNFAStates = nfa.move(currentState, symbol);
-            DFAState nextDFAState = nfa.epsilonClosure(nextNFAStates);
-
-            if (!nextDFAState.empty()) {
-                dfa.transitions[currentState][symbol] = nextDFAState;
-                if (dfa.states.find(nextDFAState) == dfa.states.end()) {
-                    dfa.states.insert(nextDFAState);
-                    q.push(nextDFAState);
-                }
+        for (size_t a = 0; a < k; a++) {
+            DFAState target = -1;
+            // Fetch the set each time, as interning may move the pool
+            if (input.move(table.get(current), a, next.data())) {
+                target = table.intern(next.data(), added);
             }
+            dfa.transitions.push_back(target);
         }
     }
 
+    dfa.sets = table.release();
     return dfa;
 }
 
+DFA NFA2DFA(const NFA& nfa, int jobs = 1) {
+    return NFA2DFA(FrozenNFA(nfa), jobs);
+}
+
+//--------------------------------------------------------------
+// DFA Minimization using Hopcroft's Partition Refinement
+// (HopcroftBlocks in Automata.h). Each block of equivalent states
+// becomes one DFA state, the union of the NFA state sets it merged.
+//--------------------------------------------------------------
+DFA MinimizeDFA(const DFA& dfa) {
+    // Id n is an implicit dead state that makes the DFA complete
+    int n = dfa.size() + 1;
+    int dead = n - 1;
+    int k = (int)dfa.symbols.size();
+    vector<int> delta((size_t)n * k, dead);
+    for (int state = 0; state < dead; state++) {
+        for (int a = 0; a < k; a++) {
+            if (dfa.next(state, a) >= 0) {
+                delta[(size_t)state * k + a] = dfa.next(state, a);
+            }
+        }
+    }
+
+    // Accepting and non-accepting states start out in separate blocks
+    vector<int> label(n);
+    for (int state = 0; state < dead; state++) {
+        label[state] = dfa.accepting[state];
+    }
+    vector<int> blockOf = HopcroftBlocks(n, k, [&](int state, int a) { return delta[(size_t)state * k + a]; }, label);
+
+    // Merge each block into one state, leaving out the block of the dead
+    // state unless the start state is in it (the DFA accepts nothing). The
+    // blocks are numbered from the start state's, then in the order their
+    // first state appears.
+    int deadBlock = blockOf[dead];
+    int startBlock = blockOf[dfa.startState];
+    vector<int> idOfBlock(n, -1);
+    vector<int> order = {dfa.startState};
+    for (int state = 0; state < dead; state++) {
+        order.push_back(state);
+    }
+    DFA minimized;
+    minimized.nfaStates = dfa.nfaStates;
+    minimized.words = dfa.words;
+    minimized.symbols = dfa.symbols;
+    copy(dfa.columnOf, dfa.columnOf + 256, minimized.columnOf);
+    for (int state : order) {
+        int b = blockOf[state];
+        if (b == deadBlock && b != startBlock) continue;
+        if (idOfBlock[b] < 0) {
+            idOfBlock[b] = minimized.size();
+            minimized.accepting.push_back(dfa.accepting[state]);
+            minimized.sets.resize(minimized.sets.size() + dfa.words, 0);
+        }
+        uint64_t* merged = minimized.sets.data() + (size_t)idOfBlock[b] * dfa.words;
+        const uint64_t* set = dfa.sets.data() + (size_t)state * dfa.words;
+        for (size_t w = 0; w < dfa.words; w++) {
+            merged[w] |= set[w];
+        }
+    }
+    minimized.startState = 0;
+    minimized.transitions.assign((size_t)minimized.size() * k, -1);
+    for (int state = 0; state < dead; state++) {
+        int b = blockOf[state];
+        if (idOfBlock[b] < 0) continue;
+        for (int a = 0; a < k; a++) {
+            int tb = blockOf[delta[(size_t)state * k + a]];
+            if (tb != deadBlock) {
+                minimized.transitions[(size_t)idOfBlock[b] * k + a] = idOfBlock[tb];
+            }
+        }
+    }
+    return minimized;
+}
+
 //--------------------------------------------------------------
 // Main Function
+//   --minimize  minimize the DFA after subset construction
 //--------------------------------------------------------------
-int main() {
+int main(int argc, char* argv[]) {
+    bool minimize = false;
+    int jobs = 1;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--minimize") {
+            minimize = true;
+        } else if (arg == "--no-minimize") {
+            minimize = false;
+        } else if (arg == "--jobs" && i + 1 < argc) {
+            jobs = max(1, atoi(argv[++i]));
+        } else {
+            cerr << "Usage: " << argv[0] << " [--[no-]minimize] [--jobs <n>]" << endl;
+            return 1;
+        }
+    }
+
     // Example NFA
     NFA nfa;
     nfa.states = {0, 1, 2};
@@ -134,40 +684,46 @@ int main() {
     nfa.transitions[2]['b'] = {2}; // Transition on 'b' from 2 to 2
 
     // Convert NFA to DFA
-    DFA dfa = NFA2DFA(nfa);
+    DFA dfa = NFA2DFA(nfa, jobs);
+    if (minimize) {
+        int before = dfa.size();
+        dfa = MinimizeDFA(dfa);
+        cerr << "DFA minimization: " << before << " -> " << dfa.size() << " states" << endl;
+    }
 
     // Print DFA states and transitions
-    cout << "DFA States:\n";
-    for (const DFAState& state : dfa.states) {
+    auto print = [&](DFAState state) {
         cout << "{ ";
-        for (NFAState s : state) {
+        for (NFAState s : dfa.nfaStatesOf(state)) {
             cout << s << " ";
         }
-        cout << "}\n";
+        cout << "}";
+    };
+    cout << "DFA States:\n";
+    for (DFAState state = 0; state < dfa.size(); state++) {
+        print(state);
+        cout << "\n";
     }
 
     cout << "\nDFA Transitions:\n";
-    for (const auto& [state, transition] : dfa.transitions) {
-        for (const auto& [symbol, nextState] : transition) {
-            cout << "{ ";
-            for (NFAState s : state) {
-                cout << s << " ";
-            }
-            cout << "} --" << symbol << "--> { ";
-            for (NFAState s : nextState) {
-                cout << s << " ";
+    for (DFAState state = 0; state < dfa.size(); state++) {
+        for (int symbol = 0; symbol < 256; symbol++) {
+            int a = dfa.columnOf[symbol];
+            if (a >= 0 && dfa.next(state, a) >= 0) {
+                print(state);
+                cout << " --" << (char)symbol << "--> ";
+                print(dfa.next(state, a));
+                cout << "\n";
             }
-            cout << "}\n";
         }
     }
 
     cout << "\nDFA Accept States:\n";
-    for (const DFAState& state : dfa.acceptStates) {
-        cout << "{ ";
-        for (NFAState s : state) {
-            cout << s << " ";
+    for (DFAState state = 0; state < dfa.size(); state++) {
+        if (dfa.accepting[state]) {
+            print(state);
+            cout << "\n";
         }
-        cout << "}\n";
     }
 
     return 0;
@@ -1,6 +1,7 @@
 #include <iostream>
 #include <stack>
 #include <string>
+#include <stdexcept>
 #include <cctype>
 
 // Function to determine operator precedence
@@ -30,7 +31,7 @@ std::string InsertConcatenation(const std::string& regex) {
             // 3. Current character is ')' and next character is an operand.
             // 4. Current character is '*' and next character is an operand or '('.
             if ((IsOperand(current) && IsOperand(next)) ||
-                (IsOperand(current) && next == '(' ||
+                (IsOperand(current) && next == '(') ||
                 (current == ')' && IsOperand(next)) ||
                 (current == '*' && (IsOperand(next) || next == '('))) {
                 result += '.';
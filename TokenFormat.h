@@ -0,0 +1,72 @@
+// Token output formats shared by mylexer and simple_lexer, so a tool that
+// reads the CSV, BINARY or COUNT output of one program reads the other's too.
+#ifndef TOKEN_FORMAT_H
+#define TOKEN_FORMAT_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+// Output formats of the token stream
+//   TEXT    each program's own listing, one token per line
+//   CSV     token,offset,length,lexeme rows after CSV_HEADER; the lexeme is
+//           quoted, with quotes doubled
+//   BINARY  one BinaryToken record per token and nothing else
+//   COUNT   nothing per token; NAME , count for every token kind at the end
+enum class OutputFormat { TEXT, CSV, BINARY, COUNT };
+
+// Record of the BINARY format, in host byte order
+struct BinaryToken {
+    int32_t kind; // the program's number for the token kind
+    uint32_t length;
+    uint64_t offset;
+};
+
+inline constexpr char CSV_HEADER[] = "token,offset,length,lexeme\n";
+
+// Format named by --format: text, csv, binary or count. False for anything else.
+inline bool ParseOutputFormat(std::string_view name, OutputFormat &format) {
+    if (name == "text") {
+        format = OutputFormat::TEXT;
+    } else if (name == "csv") {
+        format = OutputFormat::CSV;
+    } else if (name == "binary") {
+        format = OutputFormat::BINARY;
+    } else if (name == "count") {
+        format = OutputFormat::COUNT;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Append one CSV row for the token name at offset with the given lexeme
+inline void AppendCsvRow(std::string &out, std::string_view name, size_t offset, std::string_view lexeme) {
+    char numbers[48];
+    out.append(name.data(), name.size());
+    out.append(numbers, snprintf(numbers, sizeof numbers, ",%zu,%zu,\"", offset, lexeme.size()));
+    for (const char *p = lexeme.data(), *end = p + lexeme.size(); p < end;) {
+        const char *quote = (const char *)memchr(p, '"', end - p);
+        const char *stop = quote ? quote + 1 : end;
+        out.append(p, stop - p);
+        if (quote) out += '"';
+        p = stop;
+    }
+    out += "\"\n";
+}
+
+// Append one BINARY record
+inline void AppendBinary(std::string &out, int32_t kind, size_t offset, size_t length) {
+    BinaryToken record{kind, (uint32_t)length, offset};
+    out.append((const char *)&record, sizeof record);
+}
+
+// Append the COUNT line of one token kind
+inline void AppendCount(std::string &out, std::string_view name, size_t count) {
+    out.append(name.data(), name.size());
+    out += " , " + std::to_string(count) + "\n";
+}
+
+#endif
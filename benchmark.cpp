@@ -0,0 +1,421 @@
+// Benchmarks for every stage of the regex-to-lexer pipeline, across all the
+// programs in this directory. Each program is compiled into its own namespace
+// (with its main() renamed), so the stages are timed on the real code:
+//   parse   RegexParser InsertConcatenation + InfixToPostfix, mylexer InfixToPostfix
+//   nfa     mylexer PostfixToNFA (one arena NFA), Regex2NFA regex2NFA
+//   dfa     mylexer NFAtoDFA, NFA2DFA NFA2DFA
+//   scan    mylexer combined DFA, lazy DFA and per-token DFA / bit-parallel
+//           matchers, simple_lexer Lexer::getToken
+// Token specs are generated with --tokens definitions and inputs of --sizes
+// bytes from them. Every measurement runs in a forked child, so its peak RSS
+// is its own, and is printed as one JSON object per line on stdout.
+//
+// Build and run:
+//   g++ -std=c++17 -O2 -pthread -o benchmark benchmark.cpp
+//   ./benchmark [--tokens 10,100] [--sizes 1K,1M] [--stages parse,nfa,dfa,scan]
+//               [--skip <impl>,...] [--min-time <seconds>]
+// The defaults finish in a few minutes. Larger runs are opt-in: 1000 tokens
+// make mylexer.NFAtoDFA take many minutes, and every run of a 1G size builds
+// and scans a 1 GiB input per implementation, e.g.
+//   ./benchmark --tokens 1000 --sizes 1M --skip mylexer.NFAtoDFA
+//   ./benchmark --tokens 10 --sizes 1G --stages scan
+
+// Everything the programs include, at global scope, so their own #includes
+// inside the namespaces below are no-ops
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <stack>
+#include <string>
+#include <string_view>
+#include <memory>
+#include <stdexcept>
+#include <cctype>
+#include <queue>
+#include <set>
+#include <map>
+#include <tuple>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <fstream>
+#include <variant>
+#include <bitset>
+#include <cstdint>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <random>
+#include <unordered_set>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
+#include "Automata.h"
+#include "TokenFormat.h"
+
+#define main mylexer_main
+namespace mylexer {
+#include "mylexer.cpp"
+}
+#undef main
+#undef TRACE
+#undef COUNT
+
+#define main regexparser_main
+namespace regexparser {
+#include "RegexParser.cpp"
+}
+#undef main
+
+#define main regex2nfa_main
+namespace regex2nfa {
+#include "Regex2NFA.cpp"
+}
+#undef main
+
+#define main nfa2dfa_main
+namespace nfa2dfa {
+#include "NFA2DFA.cpp"
+}
+#undef main
+
+#define main simple_lexer_main
+namespace simple_lexer {
+#include "simple_lexer.cpp"
+}
+#undef main
+
+using namespace std;
+
+//--------------------------------------------------------------
+// Generated workload
+//--------------------------------------------------------------
+
+// Token i's regex, in the explicit-concatenation syntax of mylexer. The
+// tokens only use a and b (the alphabet NFA2DFA knows), and mix literals,
+// prefixes, suffixes and repetition, like keywords and identifiers do.
+string TokenRegex(int i) {
+    string code;
+    for (int bit = 0; bit < 10; bit++) {
+        code += (i >> bit) & 1 ? 'b' : 'a';
+    }
+    string literal;
+    for (char c : code) {
+        literal += literal.empty() ? string(1, c) : string(".") + c;
+    }
+    switch (i % 4) {
+    case 0: return literal;
+    case 1: return "(a|b)*." + literal;
+    case 2: return literal + ".(a|b)*";
+    default: return literal + ".a*.b*";
+    }
+}
+
+// A lexeme that token i matches
+string Lexeme(int i, mt19937 &rng) {
+    string code;
+    for (int bit = 0; bit < 10; bit++) {
+        code += (i >> bit) & 1 ? 'b' : 'a';
+    }
+    string extra;
+    for (int n = rng() % 4; n > 0; n--) {
+        extra += rng() % 2 ? 'b' : 'a';
+    }
+    switch (i % 4) {
+    case 0: return code;
+    case 1: return extra + code;
+    case 2: return code + extra;
+    default: return code + "aab";
+    }
+}
+
+struct Workload {
+    vector<pair<string, string>> tokens; // name, explicit regex
+    string input;
+};
+
+Workload MakeWorkload(int numTokens, size_t bytes) {
+    Workload work;
+    for (int i = 0; i < numTokens; i++) {
+        work.tokens.push_back({"t" + to_string(i), TokenRegex(i)});
+    }
+    mt19937 rng(12345);
+    work.input.reserve(bytes + 32);
+    while (work.input.size() < bytes) {
+        work.input += Lexeme(rng() % numTokens, rng);
+        work.input += rng() % 8 ? ' ' : '\n';
+    }
+    work.input.resize(bytes);
+    return work;
+}
+
+// The regex without the explicit '.' operators, as RegexParser reads it
+string Implicit(const string &regex) {
+    string out;
+    for (char c : regex) {
+        if (c != '.') out += c;
+    }
+    return out;
+}
+
+//--------------------------------------------------------------
+// Measurement
+//--------------------------------------------------------------
+
+struct Options {
+    vector<int> tokens = {10, 100};
+    vector<size_t> sizes = {1 << 10, 1 << 20};
+    set<string> stages = {"parse", "nfa", "dfa", "scan"};
+    set<string> skip;
+    double minTime = 0.25;
+};
+
+// Run body repeatedly until minTime has passed; returns seconds per run.
+// body returns the number of items (tokens) it handled in one run.
+template <class Body>
+double TimeRuns(double minTime, Body body, size_t &items) {
+    auto start = chrono::steady_clock::now();
+    double elapsed = 0;
+    size_t runs = 0;
+    do {
+        items = body();
+        runs++;
+        elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    } while (elapsed < minTime);
+    return elapsed / runs;
+}
+
+// Fork, build the workload and time one implementation in the child, and
+// print its result line. prepare() is given the workload and returns the body
+// to time, so whatever it builds up front is left out of the timing.
+template <class Prepare>
+void Measure(const Options &options, const string &stage, const string &impl, int numTokens, size_t bytes,
+             Prepare prepare) {
+    if (!options.stages.count(stage) || options.skip.count(impl)) return;
+    cout.flush();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return;
+    }
+    if (pid == 0) {
+        Workload work = MakeWorkload(numTokens, bytes);
+        size_t textBytes = stage == "scan" ? work.input.size() : 0;
+        if (stage != "scan") {
+            for (const auto &token : work.tokens) textBytes += token.second.size();
+            work.input.clear();
+            work.input.shrink_to_fit();
+        }
+        auto body = prepare(work);
+        size_t items = 0;
+        double seconds = TimeRuns(options.minTime, body, items);
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        printf("{\"stage\": \"%s\", \"impl\": \"%s\", \"tokens\": %d, \"input_bytes\": %zu, "
+               "\"seconds\": %.6g, \"mb_per_s\": %.6g, \"items\": %zu, \"ns_per_token\": %.6g, "
+               "\"peak_rss_kb\": %ld}\n",
+               stage.c_str(), impl.c_str(), numTokens, stage == "scan" ? bytes : (size_t)0, seconds,
+               textBytes / seconds / 1e6, items, items ? seconds * 1e9 / items : 0.0, usage.ru_maxrss);
+        fflush(stdout);
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        printf("{\"stage\": \"%s\", \"impl\": \"%s\", \"tokens\": %d, \"input_bytes\": %zu, \"error\": \"child failed\"}\n",
+               stage.c_str(), impl.c_str(), numTokens, bytes);
+        fflush(stdout);
+    }
+}
+
+// Lex all of input with a combined automaton (DFA or LazyDFA) through
+// mylexer's own ScanString, counting instead of printing; returns the token count
+template <class Automaton>
+size_t LexAll(const Automaton &dfa, const Workload &work) {
+    mylexer::TokenWriter out(work.tokens, OutputFormat::COUNT);
+    mylexer::ScanString(dfa, work.input, out);
+    return out.Counted();
+}
+
+// Lex all of input trying each token's matcher in turn, through the
+// ScanPerToken of mylexer's default mode; returns the token count
+template <class Matcher>
+size_t LexPerToken(vector<Matcher> &matchers, const Workload &work) {
+    mylexer::TokenWriter out(work.tokens, OutputFormat::COUNT);
+    mylexer::ScanPerToken(matchers, work.input, out);
+    return out.Counted();
+}
+
+// The combined NFA in NFA2DFA's form, built by Regex2NFA from one alternation
+nfa2dfa::NFA CombinedMapNFA(const vector<pair<string, string>> &tokens) {
+    string infix;
+    for (const auto &token : tokens) {
+        infix += (infix.empty() ? "(" : "|(") + token.second + ")";
+    }
+    regex2nfa::RegexToNFA converter;
+    regex2nfa::NFAFragment fragment = converter.regex2NFA(mylexer::InfixToPostfix(infix));
+    nfa2dfa::NFA nfa;
+    nfa.startState = fragment.startState;
+    nfa.acceptStates = fragment.acceptStates;
+    nfa.transitions = fragment.transitions;
+    for (const auto &row : fragment.transitions) {
+        nfa.states.insert(row.first);
+        for (const auto &edge : row.second) nfa.states.insert(edge.second.begin(), edge.second.end());
+    }
+    return nfa;
+}
+
+void RunAll(const Options &options) {
+    for (int numTokens : options.tokens) {
+        Measure(options, "parse", "RegexParser.InsertConcatenation+InfixToPostfix", numTokens, 0, [](Workload &work) {
+            vector<string> implicit;
+            for (const auto &token : work.tokens) implicit.push_back(Implicit(token.second));
+            return [implicit] {
+                size_t length = 0;
+                for (const string &regex : implicit) {
+                    length += regexparser::InfixToPostfix(regexparser::InsertConcatenation(regex)).size();
+                }
+                return length ? implicit.size() : 0;
+            };
+        });
+        Measure(options, "parse", "mylexer.InfixToPostfix", numTokens, 0, [](Workload &work) {
+            return [&work] {
+                size_t length = 0;
+                for (const auto &token : work.tokens) length += mylexer::InfixToPostfix(token.second).size();
+                return length ? work.tokens.size() : 0;
+            };
+        });
+        Measure(options, "nfa", "mylexer.PostfixToNFA", numTokens, 0, [](Workload &work) {
+            return [&work] {
+                mylexer::NFA nfa = mylexer::BuildCombinedNFA(work.tokens);
+                return nfa.states.empty() ? 0 : work.tokens.size();
+            };
+        });
+        Measure(options, "nfa", "Regex2NFA.regex2NFA", numTokens, 0, [](Workload &work) {
+            vector<string> postfix;
+            for (const auto &token : work.tokens) postfix.push_back(mylexer::InfixToPostfix(token.second));
+            return [postfix] {
+                regex2nfa::RegexToNFA converter;
+                size_t states = 0;
+                for (const string &regex : postfix) states += converter.regex2NFA(regex).transitions.size();
+                return states ? postfix.size() : 0;
+            };
+        });
+        Measure(options, "dfa", "mylexer.NFAtoDFA", numTokens, 0, [](Workload &work) {
+            auto nfa = make_shared<mylexer::NFA>(mylexer::BuildCombinedNFA(work.tokens));
+            return [nfa, &work] {
+                mylexer::DFA dfa = mylexer::NFAtoDFA(*nfa);
+                return dfa.GetNumStates() ? work.tokens.size() : 0;
+            };
+        });
+        Measure(options, "dfa", "NFA2DFA.NFA2DFA", numTokens, 0, [](Workload &work) {
+            auto nfa = make_shared<nfa2dfa::NFA>(CombinedMapNFA(work.tokens));
+            return [nfa, &work] {
+                nfa2dfa::DFA dfa = nfa2dfa::NFA2DFA(*nfa);
+                return dfa.size() == 0 ? 0 : work.tokens.size();
+            };
+        });
+        Measure(options, "dfa", "NFA2DFA.NFA2DFA-parallel", numTokens, 0, [](Workload &work) {
+            auto nfa = make_shared<nfa2dfa::NFA>(CombinedMapNFA(work.tokens));
+            int jobs = max(2, (int)thread::hardware_concurrency());
+            return [nfa, jobs, &work] {
+                nfa2dfa::DFA dfa = nfa2dfa::NFA2DFA(*nfa, jobs);
+                return dfa.size() == 0 ? 0 : work.tokens.size();
+            };
+        });
+
+        for (size_t bytes : options.sizes) {
+            Measure(options, "scan", "mylexer.combined", numTokens, bytes, [](Workload &work) {
+                auto dfa = make_shared<mylexer::DFA>(mylexer::BuildCombinedDFA(work.tokens, false));
+                return [dfa, &work] { return LexAll(*dfa, work); };
+            });
+            Measure(options, "scan", "mylexer.lazy", numTokens, bytes, [](Workload &work) {
+                auto nfa = make_shared<mylexer::NFA>(mylexer::BuildCombinedNFA(work.tokens));
+                auto dfa = make_shared<mylexer::LazyDFA>(*nfa, 10000);
+                return [nfa, dfa, &work] { return LexAll(*dfa, work); };
+            });
+            Measure(options, "scan", "mylexer.per-token-dfa", numTokens, bytes, [](Workload &work) {
+                vector<variant<mylexer::DFA>> matchers;
+                for (const auto &token : work.tokens) {
+                    mylexer::NFA nfa = mylexer::PostfixToNFA(mylexer::InfixToPostfix(token.second));
+                    matchers.emplace_back(mylexer::NFAtoDFA(nfa));
+                }
+                return [matchers, &work]() mutable { return LexPerToken(matchers, work); };
+            });
+            Measure(options, "scan", "mylexer.per-token-bits", numTokens, bytes, [](Workload &work) {
+                vector<variant<mylexer::BitMatcher<1>>> matchers;
+                for (const auto &token : work.tokens) {
+                    matchers.emplace_back(in_place_type<mylexer::BitMatcher<1>>, mylexer::InfixToPostfix(token.second));
+                }
+                return [matchers, &work]() mutable { return LexPerToken(matchers, work); };
+            });
+            // Lexer keeps its own copy of the input, so each run includes copying it
+            Measure(options, "scan", "simple_lexer.getToken", numTokens, bytes, [](Workload &work) {
+                return [&work] {
+                    simple_lexer::Lexer lexer(work.input);
+                    size_t count = 0;
+                    while (lexer.getToken().type != simple_lexer::EOS) count++;
+                    return count;
+                };
+            });
+        }
+    }
+}
+
+// "1K", "64M", "1G" or a plain byte count
+size_t ParseSize(const string &text) {
+    size_t value = stoull(text);
+    switch (toupper(text.back())) {
+    case 'K': return value << 10;
+    case 'M': return value << 20;
+    case 'G': return value << 30;
+    default: return value;
+    }
+}
+
+vector<string> SplitList(const string &text) {
+    vector<string> items;
+    stringstream ss(text);
+    string item;
+    while (getline(ss, item, ',')) {
+        if (!item.empty()) items.push_back(item);
+    }
+    return items;
+}
+
+int main(int argc, char *argv[]) {
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--tokens" && i + 1 < argc) {
+            options.tokens.clear();
+            for (const string &item : SplitList(argv[++i])) options.tokens.push_back(max(1, stoi(item)));
+        } else if (arg == "--sizes" && i + 1 < argc) {
+            options.sizes.clear();
+            for (const string &item : SplitList(argv[++i])) options.sizes.push_back(ParseSize(item));
+        } else if (arg == "--stages" && i + 1 < argc) {
+            vector<string> stages = SplitList(argv[++i]);
+            options.stages = set<string>(stages.begin(), stages.end());
+        } else if (arg == "--skip" && i + 1 < argc) {
+            vector<string> skip = SplitList(argv[++i]);
+            options.skip = set<string>(skip.begin(), skip.end());
+        } else if (arg == "--min-time" && i + 1 < argc) {
+            options.minTime = atof(argv[++i]);
+        } else {
+            cerr << "Usage: " << argv[0] << " [--tokens 10,100] [--sizes 1K,1M]"
+                 << " [--stages parse,nfa,dfa,scan] [--skip <impl>,...] [--min-time <seconds>]" << endl;
+            return 1;
+        }
+    }
+    RunAll(options);
+    return 0;
+}
@@ -2,93 +2,754 @@
 #include <sstream>
 #include <vector>
 #include <stack>
-#include <memory>
 #include <string>
+#include <string_view>
+#include <memory>
+#include <stdexcept>
 #include <cctype>
 #include <queue>
 #include <set>
 #include <map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <fstream>
+#include <variant>
+#include <bitset>
+#include <cstdint>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "Automata.h"
+#include "TokenFormat.h"
 using namespace std;
 
+// Debug tracing of construction and scanning, compiled in with -DLEXER_TRACE
+#ifdef LEXER_TRACE
+#define TRACE(x) (cout << x << '\n')
+#else
+#define TRACE(x) ((void)0)
+#endif
+
+// Transitions and restarts counted so far, taken before each token of a
+// speculative scan so that only the part of it that is kept counts
+using WorkMark = pair<uint64_t, uint64_t>;
+
+// Hot-path counters, compiled in with -DLEXER_COUNTERS. Each thread counts
+// into its own copy, which is added to the totals when the thread exits; the
+// totals are written to stderr as JSON when the program exits. The work of
+// speculative tokens that --jobs throws away is counted apart, as discarded.
+#ifdef LEXER_COUNTERS
+struct LexerCounters {
+    uint64_t bytes = 0;       // input bytes consumed, whitespace included
+    uint64_t transitions = 0; // DFA transitions taken
+    uint64_t restarts = 0;    // DFA runs started from the start state
+    uint64_t errors = 0;      // bytes no token matched
+    uint64_t discarded_transitions = 0; // taken for speculative tokens not kept
+    uint64_t discarded_restarts = 0;
+    vector<uint64_t> tokens;  // tokens emitted per type
+    uint64_t scan_ns = 0;
+    chrono::steady_clock::time_point scan_start;
+
+    void SetTokenNames(const vector<pair<string, string>> &defs);
+
+    void CountToken(int token) {
+        if ((size_t)token >= tokens.size()) tokens.resize(token + 1, 0);
+        tokens[token]++;
+    }
+
+    void StartScan() {
+        scan_start = chrono::steady_clock::now();
+    }
+
+    void StopScan() {
+        scan_ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - scan_start).count();
+    }
+
+    void Mark(vector<WorkMark> &marks) const {
+        marks.push_back({transitions, restarts});
+    }
+
+    // Move the work between the first and last marks to the discarded
+    // counts: it is speculative until Keep() says otherwise
+    void Discard(const vector<WorkMark> &marks) {
+        uint64_t moved = marks.back().first - marks.front().first;
+        transitions -= moved;
+        discarded_transitions += moved;
+        moved = marks.back().second - marks.front().second;
+        restarts -= moved;
+        discarded_restarts += moved;
+    }
+
+    // Move the work of a discarded scan from the token at marks[kept] on
+    // back: those tokens were written after all
+    void Keep(const vector<WorkMark> &marks, size_t kept) {
+        uint64_t moved = marks.back().first - marks[kept].first;
+        transitions += moved;
+        discarded_transitions -= moved;
+        moved = marks.back().second - marks[kept].second;
+        restarts += moved;
+        discarded_restarts -= moved;
+    }
+
+    void Add(const LexerCounters &other) {
+        bytes += other.bytes;
+        transitions += other.transitions;
+        restarts += other.restarts;
+        errors += other.errors;
+        discarded_transitions += other.discarded_transitions;
+        discarded_restarts += other.discarded_restarts;
+        scan_ns += other.scan_ns;
+        if (other.tokens.size() > tokens.size()) tokens.resize(other.tokens.size(), 0);
+        for (size_t i = 0; i < other.tokens.size(); i++) tokens[i] += other.tokens[i];
+    }
+};
+
+struct CounterReport {
+    mutex lock;
+    LexerCounters total;
+    vector<string> names; // token names, parallel to total.tokens
+
+    ~CounterReport() {
+        total.tokens.resize(max(total.tokens.size(), names.size()), 0);
+        cerr << "{\"bytes_scanned\": " << total.bytes
+             << ", \"transitions\": " << total.transitions
+             << ", \"dfa_restarts\": " << total.restarts
+             << ", \"errors\": " << total.errors
+             << ", \"discarded_transitions\": " << total.discarded_transitions
+             << ", \"discarded_restarts\": " << total.discarded_restarts
+             << ", \"tokens\": {";
+        for (size_t i = 0; i < names.size(); i++) {
+            cerr << (i ? ", " : "") << "\"" << names[i] << "\": " << total.tokens[i];
+        }
+        cerr << "}, \"scan_ns\": " << total.scan_ns
+             << ", \"ns_per_byte\": " << (total.bytes ? (double)total.scan_ns / total.bytes : 0.0) << "}" << endl;
+    }
+};
+CounterReport counterReport;
+
+void LexerCounters::SetTokenNames(const vector<pair<string, string>> &defs) {
+    for (const auto &def : defs) counterReport.names.push_back(def.first);
+}
+
+struct ThreadCounters : LexerCounters {
+    ~ThreadCounters() {
+        lock_guard<mutex> guard(counterReport.lock);
+        counterReport.total.Add(*this);
+    }
+};
+thread_local ThreadCounters counters;
+#define COUNT(x) ((void)(counters.x))
+#else
+#define COUNT(x) ((void)0)
+#endif
+
+// NFA Edge, labeled with the byte range [lo, hi] unless it is an epsilon edge
+struct Edge {
+    uint8_t lo;
+    uint8_t hi;
+    bool epsilon;
+    int to;   // target state id
+    int next; // next edge of the same state, -1 if last
+
+    bool Matches(char c) const {
+        return !epsilon && (unsigned char)c >= lo && (unsigned char)c <= hi;
+    }
+};
+
 // NFA State
 struct State {
-    int id;
-    vector<pair<char, shared_ptr<State>>> transitions; // transitions are labeled with characters
+    int firstEdge; // -1 if the state has no transitions
 };
 
-// NFA Structure
+// NFA Structure: states and edges live in two arenas, and a state's id is
+// its index in states, so a lookup by id is O(1)
 struct NFA {
-    shared_ptr<State> start;
-    shared_ptr<State> accept;
+    vector<State> states;
+    vector<Edge> edges;
+    int start = -1;
+    int accept = -1;
+    map<int, int> acceptTokens; // accept state id -> token index (combined NFAs only)
+
+    int AddState() {
+        states.push_back({-1});
+        return (int)states.size() - 1;
+    }
+
+    void AddEdge(int from, uint8_t lo, uint8_t hi, int to) {
+        edges.push_back({lo, hi, false, to, states[from].firstEdge});
+        states[from].firstEdge = (int)edges.size() - 1;
+    }
+
+    // One edge per run of consecutive bytes in the set
+    void AddEdges(int from, const bitset<256> &bytes, int to) {
+        for (int lo = 0; lo < 256; lo++) {
+            if (!bytes[lo]) continue;
+            int hi = lo;
+            while (hi < 255 && bytes[hi + 1]) hi++;
+            AddEdge(from, (uint8_t)lo, (uint8_t)hi, to);
+            lo = hi;
+        }
+    }
+
+    void AddEpsilon(int from, int to) {
+        edges.push_back({0, 0, true, to, states[from].firstEdge});
+        states[from].firstEdge = (int)edges.size() - 1;
+    }
+};
+
+// Start and accept state of a Thompson fragment inside an NFA arena
+struct Fragment {
+    int start;
+    int accept;
+};
+
+// Layout of a compiled DFA cache file. The header is followed by the spec
+// line (padded to 8 bytes), the 256-entry byte class map, one int32 final
+// token per state (dead state included) and the transition table.
+// CACHE_VERSION changes with the layout and with the regex syntax: the key is
+// the spec line, so a file compiled under other rules must not be reused.
+// Version 2 added character classes, escapes and the wildcard.
+const char CACHE_MAGIC[8] = {'M', 'L', 'X', 'D', 'F', 'A', 0, 0};
+const uint32_t CACHE_VERSION = 2;
+const uint32_t CACHE_BYTE_ORDER = 0x01020304;
+
+struct CacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order; // CACHE_BYTE_ORDER as written by the producing host
+    uint64_t spec_hash;
+    uint32_t spec_length;
+    uint32_t wide;       // table entries are uint32_t instead of uint16_t
+    int32_t num_states;
+    int32_t num_classes;
+    int32_t start_state;
+    int32_t dead_state;
+};
+
+// A read-only file mapping, unmapped when the last DFA using it goes away
+struct MappedFile {
+    void *addr = MAP_FAILED;
+    size_t size = 0;
+
+    ~MappedFile() {
+        if (addr != MAP_FAILED) munmap(addr, size);
+    }
+};
+
+// A set of bytes given as up to MAX_RANGES inclusive ranges, such as the
+// whitespace bytes or the bytes on which a DFA state loops back to itself.
+// SkipRun() finds the end of a run of such bytes 16 or 32 bytes at a time.
+struct ByteRun {
+    static constexpr int MAX_RANGES = 4;
+
+    int num_ranges = 0;
+    uint8_t lo[MAX_RANGES] = {};
+    uint8_t span[MAX_RANGES] = {}; // hi - lo
+    uint64_t bits[4] = {};         // membership, for the scalar path
+
+    // Build the run for a set of bytes; false if it needs too many ranges
+    bool Assign(const bool (&member)[256]) {
+        *this = ByteRun();
+        for (int c = 0; c < 256; c++) {
+            if (!member[c]) continue;
+            if (c > 0 && member[c - 1]) {
+                span[num_ranges - 1]++;
+            } else {
+                if (num_ranges == MAX_RANGES) return false;
+                lo[num_ranges] = (uint8_t)c;
+                span[num_ranges++] = 0;
+            }
+            bits[c >> 6] |= (uint64_t)1 << (c & 63);
+        }
+        return true;
+    }
+
+    bool Contains(char c) const {
+        unsigned char b = (unsigned char)c;
+        return (bits[b >> 6] >> (b & 63)) & 1;
+    }
 };
 
+// Length of the run of bytes in run at the start of p[0, n)
+size_t SkipRunScalar(const ByteRun &run, const char *p, size_t n) {
+    size_t i = 0;
+    while (i < n && run.Contains(p[i])) i++;
+    return i;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(LEXER_NO_SIMD)
+#define LEXER_SIMD 1
+#include <immintrin.h>
+
+// A byte x is in [lo, lo + span] when (x - lo) mod 256 <= span, unsigned.
+// Each block is tested against every range and the first byte outside all of
+// them is found from the comparison mask.
+__attribute__((target("sse2")))
+size_t SkipRunSSE2(const ByteRun &run, const char *p, size_t n) {
+    __m128i lo[ByteRun::MAX_RANGES], span[ByteRun::MAX_RANGES];
+    for (int r = 0; r < run.num_ranges; r++) {
+        lo[r] = _mm_set1_epi8((char)run.lo[r]);
+        span[r] = _mm_set1_epi8((char)run.span[r]);
+    }
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i in = _mm_setzero_si128();
+        for (int r = 0; r < run.num_ranges; r++) {
+            __m128i d = _mm_sub_epi8(x, lo[r]);
+            in = _mm_or_si128(in, _mm_cmpeq_epi8(_mm_min_epu8(d, span[r]), d));
+        }
+        unsigned out = ~(unsigned)_mm_movemask_epi8(in) & 0xFFFF;
+        if (out) return i + __builtin_ctz(out);
+    }
+    return i + SkipRunScalar(run, p + i, n - i);
+}
+
+__attribute__((target("avx2")))
+size_t SkipRunAVX2(const ByteRun &run, const char *p, size_t n) {
+    __m256i lo[ByteRun::MAX_RANGES], span[ByteRun::MAX_RANGES];
+    for (int r = 0; r < run.num_ranges; r++) {
+        lo[r] = _mm256_set1_epi8((char)run.lo[r]);
+        span[r] = _mm256_set1_epi8((char)run.span[r]);
+    }
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i in = _mm256_setzero_si256();
+        for (int r = 0; r < run.num_ranges; r++) {
+            __m256i d = _mm256_sub_epi8(x, lo[r]);
+            in = _mm256_or_si256(in, _mm256_cmpeq_epi8(_mm256_min_epu8(d, span[r]), d));
+        }
+        uint32_t out = ~(uint32_t)_mm256_movemask_epi8(in);
+        if (out) return i + __builtin_ctz(out);
+    }
+    return i + SkipRunSSE2(run, p + i, n - i);
+}
+#endif
+
+// Pick the widest implementation the CPU supports, once at startup
+size_t (*ChooseSkipRun())(const ByteRun &, const char *, size_t) {
+#ifdef LEXER_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return SkipRunAVX2;
+    if (__builtin_cpu_supports("sse2")) return SkipRunSSE2;
+#endif
+    return SkipRunScalar;
+}
+size_t (*const SkipRunImpl)(const ByteRun &, const char *, size_t) = ChooseSkipRun();
+
+// Length of the run of bytes in run at the start of p[0, n). Most runs are
+// short, so the first byte is checked before handing off to the vector code.
+inline size_t SkipRun(const ByteRun &run, const char *p, size_t n) {
+    if (n == 0 || !run.Contains(p[0])) return 0;
+    return 1 + SkipRunImpl(run, p + 1, n - 1);
+}
+
+// The bytes isspace() accepts in the C locale: \t \n \v \f \r and space
+const ByteRun SPACE_RUN = [] {
+    bool member[256] = {};
+    for (int c = 0; c < 256; c++) member[c] = isspace(c) != 0;
+    ByteRun run;
+    run.Assign(member);
+    return run;
+}();
+
 // DFA class definition
+// Transitions are added to Dtran while the DFA is built, on input classes:
+// groups of bytes the builder never tells apart (by default every byte is its
+// own class; see SetInputClasses()). Freeze() compiles them
+// into a dense table with one row per state and one column per byte class, so
+// a step is a single indexed load. The frozen table is immutable and shared by
+// copies of the DFA; it may also be mapped straight from a cache file by
+// LoadTable(). A DFA holds no scan state (that lives in the scan loops), so
+// one frozen DFA can be used by any number of threads at once.
 class DFA {
 public:
-    DFA(set<char> A, set<int> I, set<int> F) : alpha(A), init_states(I), fin_states(F) { Reset(); }
+    DFA(set<int> I, set<int> F) : init_states(I), fin_states(F) {
+        for (int c = 0; c < 256; c++) {
+            input_class[c] = (uint16_t)c;
+        }
+        Freeze();
+    }
 
-    void Reset() {
-        current_state = *init_states.begin();
-        accepted = false;
-        accepted_lexeme.clear();
+    // Bytes with the same input class always have the same transitions, so
+    // AddTransition() takes a class rather than every byte in it
+    void SetInputClasses(const uint16_t classes[256]) {
+        copy(classes, classes + 256, input_class);
+        frozen = false;
     }
 
-    void AddTransition(int from, int to, char symbol) {
-        Dtran[from][symbol] = to;
+    void AddTransition(int from, int to, int inputClass) {
+        Dtran[from][inputClass] = to;
+        frozen = false;
     }
 
     void AddFinalState(int state) {
         fin_states.insert(state);
+        frozen = false;
     }
 
-    bool GetAccepted() const {
-        return accepted;
+    // Final state tagged with the token it accepts (combined DFAs only)
+    void AddFinalState(int state, int token) {
+        fin_states.insert(state);
+        fin_tokens[state] = token;
+        frozen = false;
+    }
+
+    // Compile Dtran into the dense table. Bytes that lead to the same state
+    // from every state share a byte class; bytes the DFA never uses all fall
+    // into class 0, which goes to the dead state.
+    void Freeze() {
+        num_states = *init_states.begin() + 1;
+        for (const auto &row : Dtran) {
+            num_states = max(num_states, row.first + 1);
+            for (const auto &col : row.second) {
+                num_states = max(num_states, col.second + 1);
+            }
+        }
+        if (!fin_states.empty()) {
+            num_states = max(num_states, *fin_states.rbegin() + 1);
+        }
+        dead_state = num_states;
+
+        // Group input classes, and so bytes, by their column of targets
+        map<vector<int>, int> classOf;
+        vector<int> unused(num_states, dead_state);
+        classOf[unused] = 0;
+        int numInputClasses = *max_element(input_class, input_class + 256) + 1;
+        vector<vector<int>> columns(numInputClasses, unused);
+        for (const auto &row : Dtran) {
+            for (const auto &col : row.second) {
+                columns[col.first][row.first] = col.second;
+            }
+        }
+        vector<int> byteClassOf(numInputClasses);
+        for (int inputClass = 0; inputClass < numInputClasses; inputClass++) {
+            auto it = classOf.find(columns[inputClass]);
+            if (it == classOf.end()) {
+                it = classOf.insert({columns[inputClass], (int)classOf.size()}).first;
+            }
+            byteClassOf[inputClass] = it->second;
+        }
+        for (int c = 0; c < 256; c++) {
+            byte_class[c] = (uint8_t)byteClassOf[input_class[c]];
+        }
+        num_classes = (int)classOf.size();
+
+        // Rows are 16 bits wide unless the state ids don't fit
+        auto tables = make_shared<FrozenTables>();
+        wide = dead_state > UINT16_MAX;
+        size_t size = (size_t)(num_states + 1) * num_classes;
+        tables->table16.assign(wide ? 0 : size, (uint16_t)dead_state);
+        tables->table32.assign(wide ? size : 0, (uint32_t)dead_state);
+        for (const auto &column : classOf) {
+            for (int state = 0; state < num_states; state++) {
+                size_t entry = (size_t)state * num_classes + column.second;
+                if (wide) {
+                    tables->table32[entry] = (uint32_t)column.first[state];
+                } else {
+                    tables->table16[entry] = (uint16_t)column.first[state];
+                }
+            }
+        }
+
+        tables->final_token.assign(num_states + 1, NOT_FINAL);
+        for (int state : fin_states) {
+            auto it = fin_tokens.find(state);
+            tables->final_token[state] = it == fin_tokens.end() ? -1 : it->second;
+        }
+
+        table16 = tables->table16.data();
+        table32 = tables->table32.data();
+        final_token = tables->final_token.data();
+        table_owner = tables;
+        FindSelfLoops();
+        frozen = true;
     }
 
-    string GetAcceptedLexeme() const {
-        return accepted_lexeme;
+    // Write the frozen table to a cache file for the given spec line. The
+    // file is written under a temporary name and renamed into place, so
+    // readers never see a partial file.
+    bool SaveTable(const string &path, const string &spec, uint64_t specHash) const {
+        CacheHeader header = {};
+        memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+        header.version = CACHE_VERSION;
+        header.byte_order = CACHE_BYTE_ORDER;
+        header.spec_hash = specHash;
+        header.spec_length = (uint32_t)spec.size();
+        header.wide = wide;
+        header.num_states = num_states;
+        header.num_classes = num_classes;
+        header.start_state = GetStartState();
+        header.dead_state = dead_state;
+
+        string tmpPath = path + ".tmp." + to_string(getpid());
+        FILE *out = fopen(tmpPath.c_str(), "wb");
+        if (!out) return false;
+        size_t entries = (size_t)(num_states + 1) * num_classes;
+        string specPadded = spec;
+        specPadded.resize((spec.size() + 7) / 8 * 8, '\0');
+        bool ok = fwrite(&header, sizeof(header), 1, out) == 1 &&
+                  fwrite(specPadded.data(), 1, specPadded.size(), out) == specPadded.size() &&
+                  fwrite(byte_class, 1, sizeof(byte_class), out) == sizeof(byte_class) &&
+                  fwrite(final_token, sizeof(int32_t), num_states + 1, out) == (size_t)num_states + 1 &&
+                  (wide ? fwrite(table32, sizeof(uint32_t), entries, out)
+                        : fwrite(table16, sizeof(uint16_t), entries, out)) == entries;
+        ok = fclose(out) == 0 && ok;
+        if (!ok || rename(tmpPath.c_str(), path.c_str()) != 0) {
+            remove(tmpPath.c_str());
+            return false;
+        }
+        return true;
     }
 
-    bool Move(char c) {
-        if (Dtran[current_state].find(c) != Dtran[current_state].end()) {
-            current_state = Dtran[current_state][c];
-            accepted_lexeme += c;
-            cout << "Moved to state " << current_state << " on symbol " << c << endl;
-            if (fin_states.count(current_state)) {
-                accepted = true;
-            }
-            return true; // Transition successful
-        } else {
-            accepted = false;
-            return false; // Transition failed
+    // Map a cache file written by SaveTable() for the same spec line, whose
+    // DFA accepts numTokens tokens. The DFA then runs directly from the mapped
+    // table and has no Dtran. Returns false, leaving the DFA unchanged, if the
+    // file is missing, stale or malformed. Every byte class, token and table
+    // entry is checked, so a damaged file can't send a scan out of bounds.
+    bool LoadTable(const string &path, const string &spec, uint64_t specHash, int numTokens) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        auto file = make_shared<MappedFile>();
+        struct stat st;
+        if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(CacheHeader)) {
+            file->size = st.st_size;
+            file->addr = mmap(nullptr, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+        if (file->addr == MAP_FAILED) return false;
+
+        const char *base = (const char *)file->addr;
+        CacheHeader header;
+        memcpy(&header, base, sizeof(header));
+        if (memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+            header.version != CACHE_VERSION || header.byte_order != CACHE_BYTE_ORDER ||
+            header.spec_hash != specHash || header.spec_length != spec.size() ||
+            header.num_states < 0 || header.num_classes <= 0 || header.num_classes > 256 ||
+            header.dead_state != header.num_states ||
+            header.start_state < 0 || header.start_state >= header.num_states) {
+            return false;
+        }
+        size_t entries = (size_t)(header.num_states + 1) * header.num_classes;
+        size_t specOffset = sizeof(CacheHeader);
+        size_t classOffset = specOffset + (header.spec_length + 7) / 8 * 8;
+        size_t finalOffset = classOffset + 256;
+        size_t tableOffset = finalOffset + sizeof(int32_t) * (header.num_states + 1);
+        size_t endOffset = tableOffset + entries * (header.wide ? sizeof(uint32_t) : sizeof(uint16_t));
+        if (endOffset != file->size || memcmp(base + specOffset, spec.data(), spec.size()) != 0) {
+            return false;
         }
+        const uint8_t *classes = (const uint8_t *)(base + classOffset);
+        if (any_of(classes, classes + 256, [&](uint8_t c) { return c >= header.num_classes; })) {
+            return false;
+        }
+        const int32_t *tokens = (const int32_t *)(base + finalOffset);
+        if (any_of(tokens, tokens + header.num_states + 1,
+                   [&](int32_t t) { return t != NOT_FINAL && (t < -1 || t >= numTokens); })) {
+            return false;
+        }
+        const uint16_t *entries16 = (const uint16_t *)(base + tableOffset);
+        const uint32_t *entries32 = (const uint32_t *)(base + tableOffset);
+        auto outOfRange = [&](uint32_t next) { return next > (uint32_t)header.dead_state; };
+        if (header.wide ? any_of(entries32, entries32 + entries, outOfRange)
+                        : any_of(entries16, entries16 + entries, outOfRange)) {
+            return false;
+        }
+
+        wide = header.wide != 0;
+        num_states = header.num_states;
+        num_classes = header.num_classes;
+        dead_state = header.dead_state;
+        memcpy(byte_class, base + classOffset, sizeof(byte_class));
+        final_token = (const int32_t *)(base + finalOffset);
+        table16 = wide ? nullptr : (const uint16_t *)(base + tableOffset);
+        table32 = wide ? (const uint32_t *)(base + tableOffset) : nullptr;
+        table_owner = file;
+        init_states = {header.start_state};
+        fin_states.clear();
+        fin_tokens.clear();
+        Dtran.clear();
+        FindSelfLoops();
+        frozen = true;
+        return true;
+    }
+
+    bool IsFinal(int state) const {
+        return final_token[state] != NOT_FINAL;
+    }
+
+    // Token accepted in a final state, or -1 if the state is not tagged
+    int GetFinalToken(int state) const {
+        return final_token[state] == NOT_FINAL ? -1 : final_token[state];
+    }
+
+    int GetStartState() const {
+        return *init_states.begin();
+    }
+
+    int GetDeadState() const {
+        return dead_state;
+    }
+
+    int GetNumClasses() const {
+        return num_classes;
+    }
+
+    // Number of states, not counting the dead state
+    int GetNumStates() const {
+        return num_states;
     }
 
-    map<int, map<char, int>> GetTransitions() const {
-        return Dtran;
+    int GetByteClass(char symbol) const {
+        return byte_class[(unsigned char)symbol];
     }
 
-    int GetCurrentState() const {
-        return current_state;
+    // Next state on a byte class
+    int NextClass(int state, int byteClass) const {
+        size_t entry = (size_t)state * num_classes + byteClass;
+        return wide ? (int)table32[entry] : (int)table16[entry];
+    }
+
+    // Next state from the frozen table; the dead state when there is no transition
+    int Next(int state, char symbol) const {
+        size_t entry = (size_t)state * num_classes + byte_class[(unsigned char)symbol];
+        return wide ? (int)table32[entry] : (int)table16[entry];
+    }
+
+    // Ids never change, so a state is its own MunchTable id
+    int StableState(int state) const { return state; }
+
+    // Number of bytes at the start of p[0, n) on which state stays in state
+    size_t SkipSelfLoop(int state, const char *p, size_t n) const {
+        return SkipRun(self_loop[state], p, n);
     }
 
 private:
-    set<char> alpha;
+    static constexpr int NOT_FINAL = -2;
+
+    // Record the bytes on which each state loops back to itself, so runs of
+    // them (the a* in a*.b) can be skipped without stepping the table. States
+    // whose loop bytes don't fit in a few ranges are stepped as usual.
+    void FindSelfLoops() {
+        self_loop.assign(num_states + 1, ByteRun());
+        for (int state = 0; state < num_states; state++) {
+            bool member[256] = {};
+            bool any = false;
+            for (int c = 0; c < 256; c++) {
+                member[c] = NextClass(state, byte_class[c]) == state;
+                any = any || member[c];
+            }
+            if (any && !self_loop[state].Assign(member)) {
+                self_loop[state] = ByteRun();
+            }
+        }
+    }
+
+    struct FrozenTables {
+        vector<uint16_t> table16;
+        vector<uint32_t> table32;
+        vector<int32_t> final_token;
+    };
+
     set<int> init_states;
     set<int> fin_states;
-    map<int, map<char, int>> Dtran;
-    int current_state;
-    bool accepted;
-    string accepted_lexeme;
+    map<int, int> fin_tokens; // final state -> token index
+    map<int, map<int, int>> Dtran; // state -> input class -> state
+    uint16_t input_class[256]; // byte -> input class of Dtran
+
+    // Frozen form of Dtran and the final states
+    bool frozen = false;
+    bool wide = false;
+    int num_states = 0;
+    int num_classes = 0;
+    int dead_state = 0;
+    uint8_t byte_class[256] = {};
+    shared_ptr<const void> table_owner; // FrozenTables or MappedFile
+    const uint16_t *table16 = nullptr;
+    const uint32_t *table32 = nullptr;
+    const int32_t *final_token = nullptr; // token index, -1 if untagged, NOT_FINAL otherwise
+    vector<ByteRun> self_loop;            // per state, empty if it has no usable loop
 };
 
 // Check if a character is an operand (alpha or digit)
-bool IsOperand(char c) {
-    return isalpha(c) || isdigit(c);
+constexpr bool IsOperand(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+}
+
+// Byte written as \c: \n, \t and \r are control characters, anything else
+// stands for itself (\. \* \| \( \[ \\ ...)
+char EscapedByte(char c) {
+    if (c == 'n') return '\n';
+    if (c == 't') return '\t';
+    if (c == 'r') return '\r';
+    return c;
+}
+
+// Length of the atom starting at regex[i], or 0 if none starts there. An
+// atom is an operand, an escaped byte, the wildcard ? (any byte but a
+// newline; . is already concatenation) or a class such as [a-z0-9_] or
+// [^,;]. Inside a class, a leading ] or a - at either end is literal.
+size_t AtomLength(const string &regex, size_t i) {
+    char c = regex[i];
+    if (IsOperand(c) || c == '?') return 1;
+    if (c == '\\') return i + 1 < regex.size() ? 2 : 0;
+    if (c != '[') return 0;
+    size_t j = i + 1;
+    if (j < regex.size() && regex[j] == '^') j++;
+    if (j < regex.size() && regex[j] == ']') j++;
+    for (; j < regex.size(); j++) {
+        if (regex[j] == '\\') {
+            j++;
+        } else if (regex[j] == ']') {
+            return j + 1 - i;
+        }
+    }
+    return 0; // unterminated class
+}
+
+// Bytes matched by the atom of the given length at regex[i]
+bitset<256> AtomBytes(const string &regex, size_t i, size_t length) {
+    bitset<256> bytes;
+    char c = regex[i];
+    if (c == '?') {
+        bytes.set();
+        bytes.reset('\n');
+    } else if (c == '\\') {
+        bytes.set((unsigned char)EscapedByte(regex[i + 1]));
+    } else if (c != '[') {
+        bytes.set((unsigned char)c);
+    } else {
+        size_t j = i + 1;
+        size_t end = i + length - 1; // the closing ]
+        bool negated = regex[j] == '^';
+        if (negated) j++;
+        while (j < end) {
+            unsigned char lo = regex[j] == '\\' ? EscapedByte(regex[++j]) : regex[j];
+            unsigned char hi = lo;
+            j++;
+            if (j + 1 < end && regex[j] == '-') {
+                j++;
+                hi = regex[j] == '\\' ? EscapedByte(regex[++j]) : regex[j];
+                j++;
+            }
+            for (int b = lo; b <= hi; b++) bytes.set(b);
+        }
+        if (negated) bytes.flip();
+    }
+    return bytes;
 }
 
 // Function to convert infix regular expression to postfix
-int Precedence(char op) {
+constexpr int Precedence(char op) {
     if (op == '*') return 3; // highest precedence for Kleene star (*)
     if (op == '.') return 2; // concatenation (.) has lower precedence than *
     if (op == '|') return 1; // alternation (|) has the lowest precedence
@@ -100,8 +761,9 @@ string InfixToPostfix(const string &infix) {
     string postfix = ""; // resulting postfix expression 'queue'
     for (size_t i = 0; i < infix.size(); i++) {
         char c = infix[i];
-        if (IsOperand(c)) {
-            postfix += c;
+        if (size_t length = AtomLength(infix, i)) {
+            postfix += infix.substr(i, length); // atoms are copied whole
+            i += length - 1;
         } else if (c == '(') {
             ops.push(c);
         } else if (c == ')') {
@@ -109,6 +771,7 @@ string InfixToPostfix(const string &infix) {
                 postfix += ops.top();
                 ops.pop();
             }
+            if (ops.empty()) throw invalid_argument("mismatched parentheses");
             ops.pop(); // pop the '('
         } else {
             while (!ops.empty() && ops.top() != '(' && Precedence(ops.top()) >= Precedence(c)) {
@@ -119,6 +782,7 @@ string InfixToPostfix(const string &infix) {
         }
     }
     while (!ops.empty()) {
+        if (ops.top() == '(') throw invalid_argument("mismatched parentheses");
         postfix += ops.top();
         ops.pop();
     }
@@ -126,120 +790,184 @@ string InfixToPostfix(const string &infix) {
 }
 
 // Thompson's Construction: Create NFA from postfix regex
-NFA PostfixToNFA(const string &postfix) {
-    stack<NFA> nfaStack;
-    int stateId = 0;
+// The fragment is built inside nfa, so several token NFAs can share one arena.
+// Throws invalid_argument when an operator lacks operands, operands are left
+// over or the postfix holds anything else (an unterminated class, a blank).
+Fragment PostfixToNFA(const string &postfix, NFA &nfa) {
+    stack<Fragment> nfaStack;
+    auto pop = [&nfaStack]() {
+        if (nfaStack.empty()) throw invalid_argument("malformed regex");
+        Fragment top = nfaStack.top();
+        nfaStack.pop();
+        return top;
+    };
+    nfa.states.reserve(nfa.states.size() + 2 * postfix.size());
+    nfa.edges.reserve(nfa.edges.size() + 2 * postfix.size());
 
-    for (char c : postfix) {
-        if (IsOperand(c)) {
-            // Create NFA for individual character
-            auto start = make_shared<State>(State{stateId++});
-            auto accept = make_shared<State>(State{stateId++});
-            start->transitions.push_back({c, accept});
+    for (size_t i = 0; i < postfix.size(); i++) {
+        char c = postfix[i];
+        if (size_t length = AtomLength(postfix, i)) {
+            // Create NFA for an atom: one edge per byte range it matches
+            int start = nfa.AddState();
+            int accept = nfa.AddState();
+            nfa.AddEdges(start, AtomBytes(postfix, i, length), accept);
             nfaStack.push({start, accept});
-            cout << "Created NFA for operand " << c << " with start state " << start->id << " and accept state " << accept->id << endl;
+            TRACE("Created NFA for atom " << postfix.substr(i, length) << " with start state " << start << " and accept state " << accept);
+            i += length - 1;
         } else if (c == '.') {
             // Concatenation: pop two NFAs and combine
-            NFA nfa2 = nfaStack.top(); nfaStack.pop();
-            NFA nfa1 = nfaStack.top(); nfaStack.pop();
-            nfa1.accept->transitions.push_back({'\0', nfa2.start});
+            Fragment nfa2 = pop();
+            Fragment nfa1 = pop();
+            nfa.AddEpsilon(nfa1.accept, nfa2.start);
             nfaStack.push({nfa1.start, nfa2.accept});
-            cout << "Concatenated NFAs with new start state " << nfa1.start->id << " and new accept state " << nfa2.accept->id << endl;
+            TRACE("Concatenated NFAs with new start state " << nfa1.start << " and new accept state " << nfa2.accept);
         } else if (c == '|') {
             // Alternation: pop two NFAs and combine
-            NFA nfa2 = nfaStack.top(); nfaStack.pop();
-            NFA nfa1 = nfaStack.top(); nfaStack.pop();
-            auto start = make_shared<State>(State{stateId++});
-            auto accept = make_shared<State>(State{stateId++});
-            start->transitions.push_back({'\0', nfa1.start});
-            start->transitions.push_back({'\0', nfa2.start});
-            nfa1.accept->transitions.push_back({'\0', accept});
-            nfa2.accept->transitions.push_back({'\0', accept});
+            Fragment nfa2 = pop();
+            Fragment nfa1 = pop();
+            int start = nfa.AddState();
+            int accept = nfa.AddState();
+            nfa.AddEpsilon(start, nfa1.start);
+            nfa.AddEpsilon(start, nfa2.start);
+            nfa.AddEpsilon(nfa1.accept, accept);
+            nfa.AddEpsilon(nfa2.accept, accept);
             nfaStack.push({start, accept});
-            cout << "Created alternation NFA with new start state " << start->id << " and new accept state " << accept->id << endl;
+            TRACE("Created alternation NFA with new start state " << start << " and new accept state " << accept);
         } else if (c == '*') {
             // Kleene Star: pop one NFA and apply star
-            NFA nfa = nfaStack.top(); nfaStack.pop();
-            auto start = make_shared<State>(State{stateId++});
-            auto accept = make_shared<State>(State{stateId++});
-            start->transitions.push_back({'\0', nfa.start});
-            start->transitions.push_back({'\0', accept});
-            nfa.accept->transitions.push_back({'\0', nfa.start});
-            nfa.accept->transitions.push_back({'\0', accept});
+            Fragment inner = pop();
+            int start = nfa.AddState();
+            int accept = nfa.AddState();
+            nfa.AddEpsilon(start, inner.start);
+            nfa.AddEpsilon(start, accept);
+            nfa.AddEpsilon(inner.accept, inner.start);
+            nfa.AddEpsilon(inner.accept, accept);
             nfaStack.push({start, accept});
-            cout << "Applied Kleene star to NFA with new start state " << start->id << " and new accept state " << accept->id << endl;
+            TRACE("Applied Kleene star to NFA with new start state " << start << " and new accept state " << accept);
+        } else {
+            throw invalid_argument(string("unexpected '") + c + "' in regex");
         }
     }
 
-    NFA result = nfaStack.top();
-    cout << "Final NFA start state: " << result.start->id << ", accept state: " << result.accept->id << endl;
+    if (nfaStack.size() != 1) throw invalid_argument("malformed regex");
+    Fragment result = nfaStack.top();
+    TRACE("Final NFA start state: " << result.start << ", accept state: " << result.accept);
     return result;
 }
 
-// Function to retrieve NFA state by ID
-shared_ptr<State> GetStateById(const NFA &nfa, int id) {
-    queue<shared_ptr<State>> q;
-    q.push(nfa.start);
-    while (!q.empty()) {
-        auto state = q.front();
-        q.pop();
-        if (state->id == id) {
-            return state;
-        }
-        for (const auto &transition : state->transitions) {
-            q.push(transition.second);
+NFA PostfixToNFA(const string &postfix) {
+    NFA nfa;
+    Fragment fragment = PostfixToNFA(postfix, nfa);
+    nfa.start = fragment.start;
+    nfa.accept = fragment.accept;
+    return nfa;
+}
+
+// Join token fragments under one new start state; each accept state is tagged
+// with its token index, lower index = higher priority
+void CombineNFAs(NFA &nfa, const vector<Fragment> &fragments) {
+    nfa.start = nfa.AddState();
+    for (size_t i = 0; i < fragments.size(); i++) {
+        nfa.AddEpsilon(nfa.start, fragments[i].start);
+        nfa.acceptTokens[fragments[i].accept] = (int)i;
+    }
+    TRACE("Combined " << fragments.size() << " NFAs under start state " << nfa.start);
+}
+
+// Byte equivalence classes of the NFA: two bytes share a class when every
+// edge matches both or neither, so the subset construction never tells them
+// apart. Bytes no edge matches are class 0. Each distinct edge range splits
+// every class it cuts in two. Returns the number of classes.
+int ByteClasses(const NFA &nfa, uint16_t byteClass[256]) {
+    set<pair<int, int>> ranges;
+    for (const Edge &edge : nfa.edges) {
+        if (!edge.epsilon) ranges.insert({edge.lo, edge.hi});
+    }
+    vector<int> partition(256, 0); // 0: on no edge so far
+    int numParts = 1;
+    for (const auto &range : ranges) {
+        vector<int> inside(numParts, -1); // part -> its new part for the bytes in range
+        for (int c = range.first; c <= range.second; c++) {
+            if (inside[partition[c]] < 0) inside[partition[c]] = numParts++;
+            partition[c] = inside[partition[c]];
         }
     }
-    return nullptr;
+    // Renumber densely in byte order, keeping 0 for bytes on no edge
+    vector<int> renumber(numParts, -1);
+    renumber[0] = 0;
+    int numClasses = 1;
+    for (int c = 0; c < 256; c++) {
+        if (renumber[partition[c]] < 0) renumber[partition[c]] = numClasses++;
+        byteClass[c] = (uint16_t)renumber[partition[c]];
+    }
+    return numClasses;
 }
 
-// Epsilon closure function
-set<int> EpsilonClosure(const NFA &nfa, const set<int> &states) {
-    set<int> closure = states;
-    stack<int> stateStack;
+// Epsilon edges of an NFA, as EpsilonClosures (Automata.h) reads them
+struct EpsilonEdges {
+    using Cursor = int; // edge index, -1 past the last edge
+    const NFA &nfa;
+
+    int First(int state) const {
+        return nfa.states[state].firstEdge;
+    }
+
+    bool Next(int, int &edge, int &to) const {
+        while (edge >= 0 && !nfa.edges[edge].epsilon) edge = nfa.edges[edge].next;
+        if (edge < 0) return false;
+        to = nfa.edges[edge].to;
+        edge = nfa.edges[edge].next;
+        return true;
+    }
+};
+
+// Epsilon closure of a set of states. bits is scratch space of
+// closures.Words() zeroed words, and is left zeroed.
+set<int> EpsilonClosure(const EpsilonClosures &closures, const set<int> &states, vector<uint64_t> &bits) {
     for (int state : states) {
-        stateStack.push(state);
+        closures.AddTo(state, bits.data());
     }
-    while (!stateStack.empty()) {
-        int currentState = stateStack.top();
-        stateStack.pop();
-        shared_ptr<State> nfaState = GetStateById(nfa, currentState);
-        if (nfaState == nullptr) {
-            continue;
-        }
-        for (const auto &transition : nfaState->transitions) {
-            if (transition.first == '\0') {
-                int targetState = transition.second->id;
-                if (closure.find(targetState) == closure.end()) {
-                    closure.insert(targetState);
-                    stateStack.push(targetState);
-                }
-            }
+    set<int> closure;
+    for (size_t w = 0; w < bits.size(); w++) {
+        for (uint64_t word = bits[w]; word; word &= word - 1) {
+            closure.insert(closure.end(), (int)(w * 64 + __builtin_ctzll(word)));
         }
+        bits[w] = 0;
     }
     return closure;
 }
 
-// Subset construction to convert NFA to DFA
+// Subset construction to convert NFA to DFA. The alphabet is the bytes on
+// the NFA's edges, split into byte classes; each DFA state is expanded once
+// per class it has a transition on, not once per byte.
 DFA NFAtoDFA(const NFA &nfa) {
-    set<char> alphabet; // Define the alphabet dynamically
-    for (char c = 'a'; c <= 'z'; c++) {
-        alphabet.insert(c);
-    }
-    for (char c = 'A'; c <= 'Z'; c++) {
-        alphabet.insert(c);
-    }
-    for (char c = '0'; c <= '9'; c++) {
-        alphabet.insert(c);
+    uint16_t byteClass[256];
+    int numClasses = ByteClasses(nfa, byteClass);
+    // Classes matched by each edge
+    vector<vector<int>> edgeClasses(nfa.edges.size());
+    vector<int> seen(numClasses, -1);
+    for (int e = 0; e < (int)nfa.edges.size(); e++) {
+        const Edge &edge = nfa.edges[e];
+        if (edge.epsilon) continue;
+        for (int c = edge.lo; c <= edge.hi; c++) {
+            if (seen[byteClass[c]] != e) {
+                seen[byteClass[c]] = e;
+                edgeClasses[e].push_back(byteClass[c]);
+            }
+        }
     }
 
-    set<int> startSet = {nfa.start->id};
-    DFA dfa(alphabet, startSet, {}); // Initial DFA with defined alphabet and states
+    EpsilonClosures closures((int)nfa.states.size(), EpsilonEdges{nfa});
+    vector<uint64_t> bits(closures.Words(), 0);
+
+    set<int> startSet = {nfa.start};
+    DFA dfa({0}, {}); // DFA state 0 is the closure of the NFA start state
+    dfa.SetInputClasses(byteClass);
 
     map<set<int>, int> stateMapping; // Map NFA state sets to DFA state IDs
     map<int, set<int>> dfaStateSets; // Map DFA state IDs to NFA state sets
     queue<set<int>> stateQueue;
-    set<int> currentSet = EpsilonClosure(nfa, startSet);
+    set<int> currentSet = EpsilonClosure(closures, startSet, bits);
     int stateId = 0;
 
     stateMapping[currentSet] = stateId++;
@@ -250,22 +978,19 @@ DFA NFAtoDFA(const NFA &nfa) {
         currentSet = stateQueue.front();
         stateQueue.pop();
 
-        map<char, set<int>> transitions;
+        map<int, set<int>> transitions; // byte class -> NFA states reached on it
 
         for (int nfaStateId : currentSet) {
-            shared_ptr<State> nfaState = GetStateById(nfa, nfaStateId);
-            for (const auto &transition : nfaState->transitions) {
-                char symbol = transition.first;
-                if (symbol != '\0') {
-                    set<int> targetSet = EpsilonClosure(nfa, {transition.second->id});
-                    transitions[symbol].insert(targetSet.begin(), targetSet.end());
+            for (int e = nfa.states[nfaStateId].firstEdge; e >= 0; e = nfa.edges[e].next) {
+                for (int byteClassId : edgeClasses[e]) {
+                    transitions[byteClassId].insert(nfa.edges[e].to);
                 }
             }
         }
 
         for (const auto &trans : transitions) {
-            char symbol = trans.first;
-            set<int> targetSet = trans.second;
+            int byteClassId = trans.first;
+            set<int> targetSet = EpsilonClosure(closures, trans.second, bits);
 
             if (stateMapping.find(targetSet) == stateMapping.end()) {
                 stateMapping[targetSet] = stateId++;
@@ -273,8 +998,8 @@ DFA NFAtoDFA(const NFA &nfa) {
                 stateQueue.push(targetSet);
             }
 
-            dfa.AddTransition(stateMapping[currentSet], stateMapping[targetSet], symbol);
-            cout << "DFA transition from state " << stateMapping[currentSet] << " to state " << stateMapping[targetSet] << " on symbol " << symbol << endl;
+            dfa.AddTransition(stateMapping[currentSet], stateMapping[targetSet], byteClassId);
+            TRACE("DFA transition from state " << stateMapping[currentSet] << " to state " << stateMapping[targetSet] << " on byte class " << byteClassId);
         }
     }
 
@@ -282,125 +1007,2296 @@ DFA NFAtoDFA(const NFA &nfa) {
     for (const auto &stateSetPair : stateMapping) {
         const set<int> &stateSet = stateSetPair.first;
         int dfaStateId = stateSetPair.second;
-        if (stateSet.find(nfa.accept->id) != stateSet.end()) {
+        if (!nfa.acceptTokens.empty()) {
+            // Combined NFA: the first token rule wins when several accept
+            int token = -1;
+            for (const auto &acceptToken : nfa.acceptTokens) {
+                if (stateSet.count(acceptToken.first) && (token < 0 || acceptToken.second < token)) {
+                    token = acceptToken.second;
+                }
+            }
+            if (token >= 0) {
+                dfa.AddFinalState(dfaStateId, token);
+                TRACE("DFA final state: " << dfaStateId << " for token " << token);
+            }
+        } else if (stateSet.find(nfa.accept) != stateSet.end()) {
             dfa.AddFinalState(dfaStateId);
-            cout << "DFA final state: " << dfaStateId << " for NFA accept state: " << nfa.accept->id << endl;
+            TRACE("DFA final state: " << dfaStateId << " for NFA accept state: " << nfa.accept);
         }
     }
 
+    dfa.Freeze();
+    TRACE("DFA table: " << stateId << " states x " << dfa.GetNumClasses() << " byte classes");
+
     return dfa;
 }
 
-// Function to trim leading and trailing whitespace from a string
-string Trim(const string& str) {
-    size_t first = str.find_first_not_of(" \t\n\r");
-    if (first == string::npos) {
-        return ""; // String is all whitespace
+// Hopcroft's partition refinement (HopcroftBlocks in Automata.h) over the
+// frozen table. States start out grouped by what they accept (token index,
+// untagged, or nothing), so states accepting different tokens are never merged.
+DFA MinimizeDFA(const DFA &dfa) {
+    int n = dfa.GetNumStates() + 1; // the dead state makes the DFA complete
+    int k = dfa.GetNumClasses();
+    int dead = dfa.GetDeadState();
+    vector<int> label(n);
+    for (int state = 0; state < n; state++) {
+        label[state] = dfa.IsFinal(state) ? dfa.GetFinalToken(state) : -2;
     }
-    size_t last = str.find_last_not_of(" \t\n\r");
-    return str.substr(first, last - first + 1);
-}
-
-// Function to split a string by a delimiter and trim each part
-vector<string> SplitAndTrim(const string& str, char delimiter) {
-    vector<string> result;
-    stringstream ss(str);
-    string item;
-    while (getline(ss, item, delimiter)) {
-        result.push_back(Trim(item));
+    vector<int> blockOf = HopcroftBlocks(n, k, [&dfa](int state, int a) { return dfa.NextClass(state, a); }, label);
+    vector<int> rep(n, -1); // first state of each block
+    for (int state = 0; state < n; state++) {
+        if (rep[blockOf[state]] < 0) rep[blockOf[state]] = state;
     }
-    return result;
-}
 
-// Main lexer function
-int main() {
-    // Read input from stdin
-    string line;
-    getline(cin, line);
+    // Number the blocks breadth-first from the start block, leaving out the
+    // block of the dead state. The minimized DFA is built on the same byte
+    // classes.
+    uint16_t classes[256];
+    for (int c = 0; c < 256; c++) {
+        classes[c] = (uint16_t)dfa.GetByteClass((char)c);
+    }
+    int deadBlock = blockOf[dead];
+    vector<int> newId(n, -1);
+    queue<int> blockQueue;
+    int blockCount = 0;
+    newId[blockOf[dfa.GetStartState()]] = blockCount++;
+    blockQueue.push(blockOf[dfa.GetStartState()]);
 
-    // Parse token definitions
-    vector<pair<string, string>> tokens;
-    vector<string> tokenDefs = SplitAndTrim(line, ',');
-    for (const string& tokenDef : tokenDefs) {
-        size_t spacePos = tokenDef.find(' ');
-        if (spacePos != string::npos) {
-            string tokenName = tokenDef.substr(0, spacePos);
-            string tokenRegex = tokenDef.substr(spacePos + 1);
-            tokens.push_back({tokenName, tokenRegex});
+    DFA minimized({0}, {});
+    minimized.SetInputClasses(classes);
+    while (!blockQueue.empty()) {
+        int b = blockQueue.front();
+        blockQueue.pop();
+        int state = rep[b];
+        if (dfa.IsFinal(state)) {
+            if (dfa.GetFinalToken(state) >= 0) {
+                minimized.AddFinalState(newId[b], dfa.GetFinalToken(state));
+            } else {
+                minimized.AddFinalState(newId[b]);
+            }
         }
-    }
-    
-    // Remove the trailing '#' from the last token's regular expression
-    if (!tokens.empty()) {
-        string& lastTokenRegex = tokens.back().second;
-        if (!lastTokenRegex.empty() && lastTokenRegex.back() == '#') {
-            lastTokenRegex.pop_back();
+        for (int a = 0; a < k; a++) {
+            int tb = blockOf[dfa.NextClass(state, a)];
+            if (tb == deadBlock) continue;
+            if (newId[tb] < 0) {
+                newId[tb] = blockCount++;
+                blockQueue.push(tb);
+            }
+            minimized.AddTransition(newId[b], newId[tb], a);
         }
     }
+    minimized.Freeze();
+    return minimized;
+}
+
+// Minimize when enabled and report the state count before and after
+DFA MaybeMinimize(const DFA &dfa, bool minimize) {
+    if (!minimize) {
+        return dfa;
+    }
+    DFA minimized = MinimizeDFA(dfa);
+    cerr << "DFA minimization: " << dfa.GetNumStates() << " -> " << minimized.GetNumStates() << " states" << endl;
+    return minimized;
+}
 
-    // Debug: Print parsed token definitions
-    cout << "Parsed Token Definitions:" << endl;
-    for (const auto &token : tokens) {
-        cout << "Token Name: " << token.first << ", Regex: " << token.second << endl;
+// Combined DFA built while scanning instead of up front. A state is the
+// epsilon-closed set of NFA states; each one is created the first time a
+// transition reaches it and its transitions are filled in as they are taken.
+// At most max_states states are kept: when the cache is full it is flushed
+// and rebuilt from the start state, like RE2's lazy DFA. If flushes come so
+// often that the cache no longer pays for itself, it gives up on caching and
+// simulates the NFA directly. Same scanning interface as DFA; the cache is
+// mutable, so one LazyDFA must not be shared between threads.
+class LazyDFA {
+public:
+    LazyDFA(const NFA &nfa, size_t maxStates) : nfa(nfa), max_states(max(maxStates, (size_t)MIN_STATES)) {
+        num_classes = ByteClasses(nfa, byte_class);
+        accept_token.assign(nfa.states.size(), -1);
+        for (const auto &acceptToken : nfa.acceptTokens) {
+            accept_token[acceptToken.first] = acceptToken.second;
+        }
+        mark.assign(nfa.states.size(), 0);
+        Flush();
     }
 
-    // Read input string
-    getline(cin, line);
-    string inputString = Trim(line);
-    inputString = inputString.substr(1, inputString.size() - 2); // Remove surrounding quotes
+    int GetStartState() const { return START; }
+    int GetDeadState() const { return DEAD; }
+    bool IsFinal(int state) const { return final_token[state] >= 0; }
+    int GetFinalToken(int state) const { return final_token[state]; }
 
-    // Convert token definitions to NFAs and then DFAs
-    vector<DFA> dfas;
-    for (const auto &token : tokens) {
-        string postfix = InfixToPostfix(token.second);
-        // Debug: Print postfix expression
-        cout << "Infix: " << token.second << " -> Postfix: " << postfix << endl;
+    // Runs of a self-loop are stepped one byte at a time
+    size_t SkipSelfLoop(int, const char *, size_t) const { return 0; }
 
-        NFA nfa = PostfixToNFA(postfix);
-        DFA dfa = NFAtoDFA(nfa);
-        dfas.push_back(dfa);
+    // Cached ids are reused after a flush, so MunchTable gets an id of the NFA
+    // state set instead, numbered the first time the set is asked for. These
+    // are not flushed: they only cover the sets scans pass while a MunchTable
+    // has pairs ahead of them, at most one per input byte.
+    int StableState(int state) const {
+        if (stable[state] < 0) {
+            stable[state] = stable_ids.emplace(sets[state], (int)stable_ids.size()).first->second;
+        }
+        return stable[state];
     }
 
-    // Perform lexical analysis
-    cout << "Lexical Analysis Output:" << endl;
-    size_t index = 0;
-    while (index < inputString.length()) {
-        while (index < inputString.length() && isspace(inputString[index])) {
-            index++;
+    // Next state, built from the NFA if this transition hasn't been taken yet
+    int Next(int state, char symbol) const {
+        int byteClass = byte_class[(unsigned char)symbol];
+        if (byteClass == 0) return DEAD;
+        lookups++;
+        if (!fallback) {
+            int cached = rows[(size_t)state * num_classes + byteClass];
+            if (cached != UNKNOWN) {
+                hits++;
+                return cached;
+            }
         }
-        if (index >= inputString.length()) break;
+        misses++;
 
-        bool matched = false;
-        size_t longestMatchLength = 0;
-        size_t longestMatchIndex = 0;
-        string longestMatchToken;
-
-        for (size_t i = 0; i < dfas.size(); i++) {
-            DFA dfa = dfas[i];
-            dfa.Reset();
-            size_t j = index;
-            cout << "Testing DFA for token: " << tokens[i].first << endl;
-            while (j < inputString.length() && dfa.Move(inputString[j])) {
-                cout << "Moved to state " << dfa.GetCurrentState() << " on symbol " << inputString[j] << endl;
-                j++;
-            }
-            if (dfa.GetAccepted() && j - index > longestMatchLength) {
-                longestMatchLength = j - index;
-                longestMatchIndex = i;
-                longestMatchToken = dfa.GetAcceptedLexeme();
-                matched = true;
-                cout << "Accepted token: " << tokens[i].first << " with lexeme: " << longestMatchToken << endl;
+        vector<int> target = Step(sets[state], symbol);
+        if (target.empty()) {
+            if (!fallback) rows[(size_t)state * num_classes + byteClass] = DEAD;
+            return DEAD;
+        }
+        if (fallback) {
+            // NFA simulation: the target only has to outlive the next step
+            int slot = state == 1 ? 2 : 1;
+            sets[slot] = move(target);
+            final_token[slot] = TokenOf(sets[slot]);
+            stable[slot] = -1;
+            return slot;
+        }
+        auto it = ids.find(target);
+        if (it == ids.end()) {
+            if (sets.size() == max_states) {
+                CacheFull();
+                if (fallback) {
+                    sets[1] = move(target);
+                    final_token[1] = TokenOf(sets[1]);
+                    stable[1] = -1;
+                    return 1;
+                }
+                // state is gone; the caller only keeps the returned id
+                return AddState(move(target));
             }
+            int id = AddState(move(target));
+            rows[(size_t)state * num_classes + byteClass] = id;
+            return id;
         }
+        rows[(size_t)state * num_classes + byteClass] = it->second;
+        return it->second;
+    }
 
-        if (matched) {
-            cout << tokens[longestMatchIndex].first << " , \"" << longestMatchToken << "\"" << endl;
-            index += longestMatchLength;
-        } else {
-            cout << "ERROR , \"" << inputString[index] << "\"" << endl;
-            index++;
+    // Cache statistics, written to stderr after the scan
+    void Report(ostream &out) const {
+        char rate[16];
+        snprintf(rate, sizeof(rate), "%.1f%%", lookups ? 100.0 * hits / lookups : 0.0);
+        out << "Lazy DFA: " << hits << " hits, " << misses << " misses (" << rate << " hit rate), "
+            << flushes << " flushes, " << sets.size() << " states cached";
+        if (fallback) out << ", fell back to NFA simulation";
+        out << endl;
+    }
+
+private:
+    static constexpr int START = 0;
+    static constexpr int DEAD = -1;
+    static constexpr int UNKNOWN = -2;
+    static constexpr size_t MIN_STATES = 3; // start state plus two simulation slots
+    // A cache that is flushed again before it has served THRASH_LOOKUPS
+    // lookups per state, THRASH_FLUSHES times in a row, is thrashing
+    static constexpr uint64_t THRASH_LOOKUPS = 10;
+    static constexpr int THRASH_FLUSHES = 3;
+
+    // Epsilon closure of the NFA states reached from states on symbol, sorted
+    vector<int> Step(const vector<int> &states, char symbol) const {
+        vector<int> target;
+        vector<int> stateStack;
+        epoch++;
+        for (int nfaState : states) {
+            for (int e = nfa.states[nfaState].firstEdge; e >= 0; e = nfa.edges[e].next) {
+                const Edge &edge = nfa.edges[e];
+                if (edge.Matches(symbol) && mark[edge.to] != epoch) {
+                    mark[edge.to] = epoch;
+                    stateStack.push_back(edge.to);
+                }
+            }
         }
+        Close(target, stateStack);
+        return target;
     }
 
+    // Add the epsilon closure of the states on stateStack (already marked) to states
+    void Close(vector<int> &states, vector<int> &stateStack) const {
+        while (!stateStack.empty()) {
+            int nfaState = stateStack.back();
+            stateStack.pop_back();
+            states.push_back(nfaState);
+            for (int e = nfa.states[nfaState].firstEdge; e >= 0; e = nfa.edges[e].next) {
+                const Edge &edge = nfa.edges[e];
+                if (edge.epsilon && mark[edge.to] != epoch) {
+                    mark[edge.to] = epoch;
+                    stateStack.push_back(edge.to);
+                }
+            }
+        }
+        sort(states.begin(), states.end());
+    }
+
+    // The first token rule wins when several accept
+    int TokenOf(const vector<int> &states) const {
+        int token = -1;
+        for (int nfaState : states) {
+            int accepts = accept_token[nfaState];
+            if (accepts >= 0 && (token < 0 || accepts < token)) token = accepts;
+        }
+        return token;
+    }
+
+    int AddState(vector<int> states) const {
+        int id = (int)sets.size();
+        final_token.push_back(TokenOf(states));
+        stable.push_back(-1);
+        rows.resize(rows.size() + num_classes, UNKNOWN);
+        ids[states] = id;
+        sets.push_back(move(states));
+        return id;
+    }
+
+    // Drop every state but the start state
+    void Flush() const {
+        sets.clear();
+        ids.clear();
+        rows.clear();
+        final_token.clear();
+        stable.clear();
+        vector<int> start;
+        vector<int> stateStack = {nfa.start};
+        epoch++;
+        mark[nfa.start] = epoch;
+        Close(start, stateStack);
+        AddState(move(start));
+    }
+
+    // Flush a full cache, and stop caching if it keeps filling up too quickly
+    void CacheFull() const {
+        flushes++;
+        thrashing = lookups - lookups_at_flush < THRASH_LOOKUPS * max_states ? thrashing + 1 : 0;
+        lookups_at_flush = lookups;
+        Flush();
+        if (thrashing >= THRASH_FLUSHES) {
+            fallback = true;
+            sets.resize(MIN_STATES);
+            final_token.assign(MIN_STATES, -1);
+            final_token[START] = TokenOf(sets[START]);
+            stable.assign(MIN_STATES, -1);
+            ids.clear();
+            rows.clear();
+        }
+    }
+
+    const NFA &nfa;
+    size_t max_states;
+    uint16_t byte_class[256] = {};
+    int num_classes = 1;
+    vector<int> accept_token; // per NFA state, -1 if it accepts nothing
+
+    mutable vector<vector<int>> sets;   // NFA state set of each cached state
+    mutable map<vector<int>, int> ids;  // NFA state set -> cached state
+    mutable vector<int32_t> rows;       // transitions, num_classes per state
+    mutable vector<int32_t> final_token;
+    mutable vector<int> stable;         // StableState() of each cached state, -1 if not asked yet
+    mutable map<vector<int>, int> stable_ids; // NFA state set -> StableState(), kept across flushes
+    mutable vector<uint32_t> mark;      // epoch stamps for closures
+    mutable uint32_t epoch = 0;
+    mutable bool fallback = false;
+    mutable int thrashing = 0;
+    mutable uint64_t lookups = 0;
+    mutable uint64_t hits = 0;
+    mutable uint64_t misses = 0;
+    mutable uint64_t flushes = 0;
+    mutable uint64_t lookups_at_flush = 0;
+};
+
+// Glushkov position automaton of one token regex, simulated with bitmasks of
+// Words machine words. Position 0 is the initial position and every operand
+// in the regex is one more position, so there are no epsilon transitions and
+// a step is a few table lookups and ANDs. Same matching interface as DFA.
+template <int Words>
+class BitMatcher {
+public:
+    static constexpr int MAX_POSITIONS = 64 * Words;
+
+    struct Mask {
+        uint64_t word[Words] = {};
+
+        void Set(int position) { word[position >> 6] |= (uint64_t)1 << (position & 63); }
+        bool Test(int position) const { return (word[position >> 6] >> (position & 63)) & 1; }
+        bool Any() const {
+            uint64_t any = 0;
+            for (int w = 0; w < Words; w++) any |= word[w];
+            return any != 0;
+        }
+        Mask &operator|=(const Mask &other) {
+            for (int w = 0; w < Words; w++) word[w] |= other.word[w];
+            return *this;
+        }
+        Mask &operator&=(const Mask &other) {
+            for (int w = 0; w < Words; w++) word[w] &= other.word[w];
+            return *this;
+        }
+        bool operator<(const Mask &other) const {
+            return lexicographical_compare(word, word + Words, other.word, other.word + Words);
+        }
+    };
+
+    // Build from a postfix regex with at most MAX_POSITIONS - 1 atoms
+    explicit BitMatcher(const string &postfix) : follow_table(BYTES * 256) {
+        struct Glushkov {
+            bool nullable;
+            Mask first;
+            Mask last;
+        };
+        vector<Mask> follow(1);
+        stack<Glushkov> fragments;
+        for (size_t i = 0; i < postfix.size(); i++) {
+            char c = postfix[i];
+            if (size_t length = AtomLength(postfix, i)) {
+                int position = (int)follow.size();
+                follow.push_back(Mask());
+                Mask only;
+                only.Set(position);
+                bitset<256> bytes = AtomBytes(postfix, i, length);
+                for (int b = 0; b < 256; b++) {
+                    if (bytes[b]) byte_mask[b].Set(position);
+                }
+                fragments.push({false, only, only});
+                i += length - 1;
+            } else if (c == '.') {
+                Glushkov b = fragments.top(); fragments.pop();
+                Glushkov a = fragments.top(); fragments.pop();
+                AddFollow(follow, a.last, b.first);
+                Glushkov ab = {a.nullable && b.nullable, a.first, b.last};
+                if (a.nullable) ab.first |= b.first;
+                if (b.nullable) ab.last |= a.last;
+                fragments.push(ab);
+            } else if (c == '|') {
+                Glushkov b = fragments.top(); fragments.pop();
+                Glushkov a = fragments.top(); fragments.pop();
+                a.nullable = a.nullable || b.nullable;
+                a.first |= b.first;
+                a.last |= b.last;
+                fragments.push(a);
+            } else if (c == '*') {
+                Glushkov a = fragments.top(); fragments.pop();
+                AddFollow(follow, a.last, a.first);
+                a.nullable = true;
+                fragments.push(a);
+            }
+        }
+        Glushkov result = fragments.top();
+        follow[0] = result.first;
+        final_mask = result.last;
+        if (result.nullable) final_mask.Set(0);
+        num_bytes = ((int)follow.size() + 7) / 8;
+        TRACE("Glushkov automaton: " << follow.size() << " positions");
+
+        // follow_table[k][b]: union of follow() over the positions set in byte k of a mask
+        for (int k = 0; k < num_bytes; k++) {
+            for (int b = 1; b < 256; b++) {
+                Mask &entry = follow_table[k * 256 + b];
+                for (int bit = 0; bit < 8; bit++) {
+                    int position = k * 8 + bit;
+                    if ((b >> bit) & 1 && position < (int)follow.size()) entry |= follow[position];
+                }
+            }
+        }
+        Reset();
+    }
+
+    // Positions (atoms plus the initial position) a postfix regex needs
+    static int CountPositions(const string &postfix) {
+        int positions = 1;
+        for (size_t i = 0; i < postfix.size(); i++) {
+            if (size_t length = AtomLength(postfix, i)) {
+                positions++;
+                i += length - 1;
+            }
+        }
+        return positions;
+    }
+
+    void Reset() {
+        current = Mask();
+        current.Set(0);
+        accepted = false;
+        length = 0;
+        accepted_length = 0;
+    }
+
+    bool Move(char c) {
+        Mask next;
+        for (int k = 0; k < num_bytes; k++) {
+            unsigned bits = (current.word[k / 8] >> (k % 8 * 8)) & 0xFF;
+            if (bits) next |= follow_table[k * 256 + bits];
+        }
+        next &= byte_mask[(unsigned char)c];
+        if (!next.Any()) {
+            return false; // Transition failed, keep the last accepted prefix
+        }
+        COUNT(transitions++);
+        current = next;
+        length++;
+        Mask accepting = current;
+        accepting &= final_mask;
+        if (accepting.Any()) {
+            accepted = true;
+            accepted_length = length;
+        }
+        return true;
+    }
+
+    bool GetAccepted() const {
+        return accepted;
+    }
+
+    size_t GetAcceptedLength() const {
+        return accepted_length;
+    }
+
+    // MunchTable id of the current position set, numbered as sets are first seen
+    int StableState() {
+        return stable_ids.emplace(current, (int)stable_ids.size()).first->second;
+    }
+
+private:
+    static constexpr int BYTES = 8 * Words;
+
+    static void AddFollow(vector<Mask> &follow, const Mask &from, const Mask &to) {
+        for (int position = 0; position < (int)follow.size(); position++) {
+            if (from.Test(position)) follow[position] |= to;
+        }
+    }
+
+    vector<Mask> follow_table; // BYTES x 256
+    int num_bytes = 0;         // bytes of a mask that hold positions
+    Mask byte_mask[256];       // positions labeled with each byte
+    Mask final_mask;
+    Mask current;
+    bool accepted;
+    size_t length;
+    size_t accepted_length;
+    map<Mask, int> stable_ids;
+};
+
+// Function to trim leading and trailing whitespace from a string
+string Trim(const string& str) {
+    size_t first = str.find_first_not_of(" \t\n\r");
+    if (first == string::npos) {
+        return ""; // String is all whitespace
+    }
+    size_t last = str.find_last_not_of(" \t\n\r");
+    return str.substr(first, last - first + 1);
+}
+
+// Trim a token definition. Like Trim, but whitespace inside a regex atom
+// (the escaped blank \  or [ ]) is kept even at the end. test_3.txt ends its
+// regexes with \ ; mylexer < test_3.txt prints test_3.expected.
+string TrimDefinition(const string& str) {
+    size_t first = str.find_first_not_of(" \t\n\r");
+    if (first == string::npos) {
+        return "";
+    }
+    size_t kept = first; // end of the last atom or non-blank
+    for (size_t i = first; i < str.size(); i++) {
+        if (size_t length = (str[i] == '[' || str[i] == '\\') ? AtomLength(str, i) : 0) {
+            i += length - 1;
+            kept = i + 1;
+        } else if (str[i] != ' ' && str[i] != '\t' && str[i] != '\n' && str[i] != '\r') {
+            kept = i + 1;
+        }
+    }
+    return str.substr(first, kept - first);
+}
+
+// Function to split a string by a delimiter and trim each part. A delimiter
+// inside a regex atom ([,;] or \,) does not split.
+vector<string> SplitAndTrim(const string& str, char delimiter) {
+    vector<string> result;
+    string item;
+    for (size_t i = 0; i < str.size(); i++) {
+        if (str[i] == delimiter) {
+            result.push_back(TrimDefinition(item));
+            item.clear();
+        } else if (size_t length = (str[i] == '[' || str[i] == '\\') ? AtomLength(str, i) : 0) {
+            item += str.substr(i, length);
+            i += length - 1;
+        } else {
+            item += str[i];
+        }
+    }
+    if (!item.empty()) {
+        result.push_back(TrimDefinition(item));
+    }
+    return result;
+}
+
+//--------------------------------------------------------------
+// Compile-time lexer
+// compile_lexer() runs the same pipeline as the runtime path (infix to
+// postfix with Precedence, Thompson's construction, subset construction
+// into one combined DFA) as a constant expression, for token sets fixed at
+// build time:
+//     static constexpr auto lexer = compile_lexer("t1 a|b , t2 a*.a #");
+// Operands are single alphanumerics only; any other character (classes,
+// escapes, ?, spaces ...) is a compile error rather than being skipped, so
+// a spec never compiles to something the runtime path would not. Everything
+// lives in fixed-size arrays. A spec that overflows them is a compile error
+// too; raise the template limits for larger sets (big specs may also need
+// -fconstexpr-ops-limit).
+//--------------------------------------------------------------
+
+// Set of NFA states as a bit vector
+template <int Words>
+struct StaticStateSet {
+    uint64_t bits[Words] = {};
+
+    constexpr void Insert(int state) {
+        bits[state / 64] |= (uint64_t)1 << (state % 64);
+    }
+
+    constexpr bool Contains(int state) const {
+        return (bits[state / 64] >> (state % 64)) & 1;
+    }
+
+    constexpr bool Empty() const {
+        for (int i = 0; i < Words; i++) {
+            if (bits[i]) return false;
+        }
+        return true;
+    }
+
+    constexpr bool operator==(const StaticStateSet &other) const {
+        for (int i = 0; i < Words; i++) {
+            if (bits[i] != other.bits[i]) return false;
+        }
+        return true;
+    }
+};
+
+// Thompson NFA in fixed arrays; every state has at most two edges
+template <int MaxNfaStates>
+struct StaticNFA {
+    char symbol[MaxNfaStates][2] = {}; // '\0' for epsilon
+    int to[MaxNfaStates][2] = {};
+    int edges[MaxNfaStates] = {};
+    int num_states = 0;
+
+    constexpr int AddState() {
+        if (num_states == MaxNfaStates) throw length_error("compile_lexer: too many NFA states");
+        return num_states++;
+    }
+
+    constexpr void AddEdge(int from, char c, int target) {
+        symbol[from][edges[from]] = c;
+        to[from][edges[from]++] = target;
+    }
+};
+
+// Combined DFA produced by compile_lexer(); same scanning interface as DFA
+template <int MaxStates, int MaxTokens>
+struct StaticLexer {
+    static constexpr int MAX_CLASSES = 64; // 62 operand characters, plus everything else
+    static constexpr int MAX_NAME = 32;
+
+    int num_states = 0;
+    int num_classes = 1;
+    int num_tokens = 0;
+    uint8_t byte_class[256] = {};
+    uint16_t table[MaxStates + 1][MAX_CLASSES] = {};
+    int16_t final_token[MaxStates + 1] = {}; // -1 if not final
+    char names[MaxTokens][MAX_NAME] = {};
+    uint8_t name_length[MaxTokens] = {};
+
+    constexpr int GetStartState() const { return 0; }
+    constexpr int GetDeadState() const { return num_states; }
+    constexpr bool IsFinal(int state) const { return final_token[state] >= 0; }
+    constexpr int GetFinalToken(int state) const { return final_token[state]; }
+    constexpr string_view GetTokenName(int token) const { return string_view(names[token], name_length[token]); }
+
+    constexpr int Next(int state, char c) const {
+        return table[state][byte_class[(unsigned char)c]];
+    }
+
+    // The compiled-in tables are small; self-loops are stepped like any other transition
+    size_t SkipSelfLoop(int, const char *, size_t) const { return 0; }
+
+    constexpr int StableState(int state) const { return state; }
+
+    // Length of the longest match at the start of input (0 if none)
+    constexpr size_t LongestMatch(string_view input, int &token) const {
+        int state = GetStartState();
+        size_t longest = 0;
+        token = -1;
+        for (size_t j = 0; j < input.size(); j++) {
+            state = Next(state, input[j]);
+            if (state == GetDeadState()) break;
+            if (IsFinal(state)) {
+                longest = j + 1;
+                token = GetFinalToken(state);
+            }
+        }
+        return longest;
+    }
+};
+
+template <int Words, int MaxNfaStates>
+constexpr void StaticEpsilonClosure(const StaticNFA<MaxNfaStates> &nfa, StaticStateSet<Words> &states) {
+    int stack[MaxNfaStates] = {};
+    int top = 0;
+    for (int state = 0; state < nfa.num_states; state++) {
+        if (states.Contains(state)) stack[top++] = state;
+    }
+    while (top > 0) {
+        int state = stack[--top];
+        for (int e = 0; e < nfa.edges[state]; e++) {
+            if (nfa.symbol[state][e] == '\0' && !states.Contains(nfa.to[state][e])) {
+                states.Insert(nfa.to[state][e]);
+                stack[top++] = nfa.to[state][e];
+            }
+        }
+    }
+}
+
+template <int MaxStates = 64, int MaxTokens = 16, int MaxNfaStates = 256>
+constexpr StaticLexer<MaxStates, MaxTokens> compile_lexer(string_view spec) {
+    constexpr int Words = (MaxNfaStates + 63) / 64;
+    using Lexer = StaticLexer<MaxStates, MaxTokens>;
+    Lexer lexer{};
+    StaticNFA<MaxNfaStates> nfa{};
+    int tokenStart[MaxTokens] = {};
+    int acceptToken[MaxNfaStates] = {};
+    for (int i = 0; i < MaxNfaStates; i++) acceptToken[i] = -1;
+
+    // Split the spec into "name regex" definitions, as main() does
+    size_t pos = 0;
+    while (pos < spec.size()) {
+        size_t comma = spec.find(',', pos);
+        string_view def = spec.substr(pos, comma == string_view::npos ? string_view::npos : comma - pos);
+        pos = comma == string_view::npos ? spec.size() : comma + 1;
+        while (!def.empty() && (def.front() == ' ' || def.front() == '\t')) def.remove_prefix(1);
+        while (!def.empty() && (def.back() == ' ' || def.back() == '\t' || def.back() == '#')) def.remove_suffix(1);
+        size_t space = def.find(' ');
+        if (space == string_view::npos) continue;
+        if (lexer.num_tokens == MaxTokens) throw length_error("compile_lexer: too many tokens");
+        string_view name = def.substr(0, space);
+        string_view regex = def.substr(space + 1);
+        if (name.size() >= Lexer::MAX_NAME) throw length_error("compile_lexer: token name too long");
+        for (size_t i = 0; i < name.size(); i++) lexer.names[lexer.num_tokens][i] = name[i];
+        lexer.name_length[lexer.num_tokens] = (uint8_t)name.size();
+
+        // Infix to postfix, with the runtime operators and Precedence
+        char postfix[MaxNfaStates] = {};
+        char ops[MaxNfaStates] = {};
+        int length = 0;
+        int top = 0;
+        for (char c : regex) {
+            if (length >= MaxNfaStates - 1 || top >= MaxNfaStates - 1) throw length_error("compile_lexer: regex too long");
+            if (IsOperand(c)) {
+                postfix[length++] = c;
+            } else if (c == '(') {
+                ops[top++] = c;
+            } else if (c == ')') {
+                while (top > 0 && ops[top - 1] != '(') postfix[length++] = ops[--top];
+                if (top == 0) throw invalid_argument("compile_lexer: mismatched parentheses");
+                top--;
+            } else if (Precedence(c) > 0) {
+                while (top > 0 && ops[top - 1] != '(' && Precedence(ops[top - 1]) >= Precedence(c)) {
+                    postfix[length++] = ops[--top];
+                }
+                ops[top++] = c;
+            } else {
+                throw invalid_argument("compile_lexer: unsupported character in regex");
+            }
+        }
+        while (top > 0) postfix[length++] = ops[--top];
+
+        // Thompson's construction
+        int starts[MaxNfaStates] = {};
+        int accepts[MaxNfaStates] = {};
+        int depth = 0;
+        for (int i = 0; i < length; i++) {
+            char c = postfix[i];
+            if (IsOperand(c)) {
+                int start = nfa.AddState();
+                int accept = nfa.AddState();
+                nfa.AddEdge(start, c, accept);
+                starts[depth] = start;
+                accepts[depth++] = accept;
+            } else if (c == '.' && depth >= 2) {
+                depth--;
+                nfa.AddEdge(accepts[depth - 1], '\0', starts[depth]);
+                accepts[depth - 1] = accepts[depth];
+            } else if (c == '|' && depth >= 2) {
+                depth--;
+                int start = nfa.AddState();
+                int accept = nfa.AddState();
+                nfa.AddEdge(start, '\0', starts[depth - 1]);
+                nfa.AddEdge(start, '\0', starts[depth]);
+                nfa.AddEdge(accepts[depth - 1], '\0', accept);
+                nfa.AddEdge(accepts[depth], '\0', accept);
+                starts[depth - 1] = start;
+                accepts[depth - 1] = accept;
+            } else if (c == '*' && depth >= 1) {
+                int start = nfa.AddState();
+                int accept = nfa.AddState();
+                nfa.AddEdge(start, '\0', starts[depth - 1]);
+                nfa.AddEdge(start, '\0', accept);
+                nfa.AddEdge(accepts[depth - 1], '\0', starts[depth - 1]);
+                nfa.AddEdge(accepts[depth - 1], '\0', accept);
+                starts[depth - 1] = start;
+                accepts[depth - 1] = accept;
+            } else {
+                throw invalid_argument("compile_lexer: malformed regex");
+            }
+        }
+        if (depth != 1) throw invalid_argument("compile_lexer: malformed regex");
+        tokenStart[lexer.num_tokens] = starts[0];
+        acceptToken[accepts[0]] = lexer.num_tokens;
+        lexer.num_tokens++;
+    }
+
+    // Byte classes: one per operand character used, class 0 for the rest
+    char classSymbol[Lexer::MAX_CLASSES] = {};
+    for (int state = 0; state < nfa.num_states; state++) {
+        for (int e = 0; e < nfa.edges[state]; e++) {
+            char c = nfa.symbol[state][e];
+            if (c != '\0' && lexer.byte_class[(unsigned char)c] == 0) {
+                classSymbol[lexer.num_classes] = c;
+                lexer.byte_class[(unsigned char)c] = (uint8_t)lexer.num_classes++;
+            }
+        }
+    }
+
+    // Subset construction from the union of the token start states
+    StaticStateSet<Words> dstates[MaxStates] = {};
+    int next[MaxStates][Lexer::MAX_CLASSES] = {};
+    for (int i = 0; i < lexer.num_tokens; i++) dstates[0].Insert(tokenStart[i]);
+    StaticEpsilonClosure(nfa, dstates[0]);
+    int count = 1;
+    for (int i = 0; i < count; i++) {
+        for (int k = 1; k < lexer.num_classes; k++) {
+            StaticStateSet<Words> target{};
+            for (int state = 0; state < nfa.num_states; state++) {
+                if (!dstates[i].Contains(state)) continue;
+                for (int e = 0; e < nfa.edges[state]; e++) {
+                    if (nfa.symbol[state][e] == classSymbol[k]) target.Insert(nfa.to[state][e]);
+                }
+            }
+            next[i][k] = -1;
+            if (target.Empty()) continue;
+            StaticEpsilonClosure(nfa, target);
+            int j = 0;
+            while (j < count && !(dstates[j] == target)) j++;
+            if (j == count) {
+                if (count == MaxStates) throw length_error("compile_lexer: too many DFA states");
+                dstates[count++] = target;
+            }
+            next[i][k] = j;
+        }
+    }
+
+    // Dense table with the dead state in row count; the first rule wins
+    lexer.num_states = count;
+    for (int i = 0; i <= count; i++) {
+        lexer.final_token[i] = -1;
+        for (int k = 0; k < Lexer::MAX_CLASSES; k++) {
+            lexer.table[i][k] = (uint16_t)(i < count && k > 0 && k < lexer.num_classes && next[i][k] >= 0 ? next[i][k] : count);
+        }
+        for (int state = 0; i < count && state < nfa.num_states; state++) {
+            int token = acceptToken[state];
+            if (token >= 0 && dstates[i].Contains(state) && (lexer.final_token[i] < 0 || token < lexer.final_token[i])) {
+                lexer.final_token[i] = (int16_t)token;
+            }
+        }
+    }
+    return lexer;
+}
+
+// Token set built into the binary, lexed with --builtin
+static constexpr auto kBuiltinLexer = compile_lexer("t1 a|b , t2 a*.a , t3 (a|b)*.c*.c #");
+static_assert(kBuiltinLexer.num_tokens == 3 && kBuiltinLexer.GetTokenName(2) == "t3", "built-in token set");
+
+// A token as a span of the input. The lexeme text is only copied out of the
+// input when the token is printed.
+struct Token {
+    int kind;      // token index, -1 for ERROR
+    size_t offset;
+    size_t length;
+};
+
+// Writes the token stream to stdout in one of the OutputFormats of
+// TokenFormat.h. The TEXT listing is NAME , "lexeme" per token, after a
+// "Lexical Analysis Output:" line; BINARY kinds are token indexes, -1 for
+// ERROR. Tokens are formatted into one large buffer, which goes out in a
+// single write() whenever it fills, instead of through iostream formatting
+// and an endl flush per token.
+class TokenWriter {
+public:
+    TokenWriter(const vector<pair<string, string>> &tokens, OutputFormat format)
+        : tokens(tokens), format(format), counts(tokens.size() + 1, 0) {
+        buffer.reserve(BUFFER_SIZE + 4096);
+    }
+
+    bool Counting() const { return format == OutputFormat::COUNT; }
+    bool Text() const { return format == OutputFormat::TEXT; }
+    size_t NumTokens() const { return tokens.size(); }
+
+    // The header line of the TEXT and CSV formats
+    void Begin() {
+        if (format == OutputFormat::TEXT) {
+            buffer += "Lexical Analysis Output:\n";
+        } else if (format == OutputFormat::CSV) {
+            buffer += CSV_HEADER;
+        }
+    }
+
+    // text points at the lexeme in the input
+    void Write(const Token &token, const char *text) {
+        if (Counting()) {
+            counts[token.kind + 1]++;
+            return;
+        }
+        Format(buffer, token, text);
+        if (buffer.size() >= BUFFER_SIZE) Flush();
+    }
+
+    // Output already formatted with Format(), e.g. by another thread
+    void Write(string_view formatted) {
+        buffer.append(formatted.data(), formatted.size());
+        if (buffer.size() >= BUFFER_SIZE) Flush();
+    }
+
+    // Append token to out in the output format; nothing when counting. Safe
+    // to call from several threads.
+    void Format(string &out, const Token &token, const char *text) const {
+        const string &name = token.kind < 0 ? ERROR_NAME : tokens[token.kind].first;
+        switch (format) {
+        case OutputFormat::TEXT:
+            out += name;
+            out += " , \"";
+            out.append(text, token.length);
+            out += "\"\n";
+            break;
+        case OutputFormat::CSV:
+            AppendCsvRow(out, name, token.offset, string_view(text, token.length));
+            break;
+        case OutputFormat::BINARY:
+            AppendBinary(out, token.kind, token.offset, token.length);
+            break;
+        case OutputFormat::COUNT:
+            break;
+        }
+    }
+
+    // Tokens tallied so far when counting, ERROR tokens included
+    size_t Counted() const {
+        size_t total = 0;
+        for (size_t count : counts) total += count;
+        return total;
+    }
+
+    // Add tallies made elsewhere, indexed by token index + 1
+    void AddCounts(const vector<size_t> &more) {
+        for (size_t i = 0; i < counts.size(); i++) {
+            counts[i] += more[i];
+        }
+    }
+
+    // Write out the tallies when counting, and whatever is still buffered
+    void Finish() {
+        if (Counting()) {
+            for (size_t i = 0; i < counts.size(); i++) {
+                size_t kind = (i + 1) % counts.size(); // ERROR last
+                AppendCount(buffer, kind == 0 ? ERROR_NAME : tokens[kind - 1].first, counts[kind]);
+            }
+        }
+        Flush();
+    }
+
+private:
+    static constexpr size_t BUFFER_SIZE = 1 << 20;
+    inline static const string ERROR_NAME = "ERROR";
+
+    void Flush() {
+        cout.flush(); // anything written through cout goes first
+        for (size_t done = 0; done < buffer.size();) {
+            ssize_t written = write(STDOUT_FILENO, buffer.data() + done, buffer.size() - done);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                perror("write");
+                break;
+            }
+            done += written;
+        }
+        buffer.clear();
+    }
+
+    const vector<pair<string, string>> &tokens;
+    OutputFormat format;
+    vector<size_t> counts; // per token index + 1, ERROR first
+    string buffer;
+};
+
+// Reps' tabulation for maximal munch ("Maximal-munch" tokenization in linear
+// time, TOPLAS 1998). Restarting the DFA after every token is quadratic when
+// each scan runs far past its last accept and then fails, as (a.b)*.c does
+// over a long run of ab's. A scan that fails has shown that no accepting state
+// can be reached from any (state, position) it visited after its last accept,
+// so those pairs are recorded and any later scan reaching one of them stops
+// there. Every pair then fails at most once, and the whole tokenization is
+// O(n) transitions.
+//
+// The scan loops only test pairs; the failed stretch is walked again by
+// Fail() to record it, which costs no more than the scan did. Scans start at
+// increasing positions, so pairs before the start of the latest scan are
+// never asked about again: they are dropped when the table grows, and memory
+// follows the pairs still ahead, not the input size. States are the
+// automaton's StableState() ids, which don't change while the table is used.
+class MunchTable {
+public:
+    // Whether Failed() can be true at position: nothing is recorded from high on
+    bool Covers(size_t position) const {
+        return position < high;
+    }
+
+    // Whether a scan in state at position is known to find no further accept
+    bool Failed(int state, size_t position) const {
+        if (position >= high) return false;
+        for (size_t slot = Hash(position, state); slots[slot].position != EMPTY; slot = (slot + 1) & mask) {
+            if (slots[slot].position == position && slots[slot].state == state) return true;
+        }
+        return false;
+    }
+
+    // A scan started at begin, had its last accept at (or started at) from,
+    // and stopped at end: record every pair it visited in between.
+    // stateAt(position) is the scan's state at position, asked for in
+    // increasing order. The pair whose byte leads to the dead state isn't
+    // recorded (end is at it): reaching it again costs a single step anyway,
+    // and that is the only pair a scan that stops right after its last
+    // accept would record.
+    template <class StateAt>
+    void Fail(size_t begin, size_t from, size_t end, StateAt stateAt) {
+        low = begin;
+        for (size_t position = from; position < end; position++) {
+            Add(stateAt(position), position);
+        }
+        high = max(high, end);
+    }
+
+private:
+    static constexpr size_t EMPTY = SIZE_MAX;
+
+    struct Slot {
+        size_t position = EMPTY;
+        int state = 0;
+    };
+
+    size_t low = 0;   // pairs before this position are dead
+    size_t high = 0;  // positions from here on have nothing recorded
+    size_t used = 0;  // slots holding a pair, dead or not
+    size_t mask = 0;
+    vector<Slot> slots; // open addressing; allocated on the first failure
+
+    size_t Hash(size_t position, int state) const {
+        uint64_t h = (position * 0x9e3779b97f4a7c15ULL) ^ ((uint64_t)(uint32_t)state * 0xc2b2ae3d27d4eb4fULL);
+        return (h ^ h >> 29) & mask;
+    }
+
+    void Add(int state, size_t position) {
+        if ((used + 1) * 2 > slots.size()) Rehash();
+        size_t slot = Hash(position, state);
+        for (; slots[slot].position != EMPTY; slot = (slot + 1) & mask) {
+            if (slots[slot].position == position && slots[slot].state == state) return;
+        }
+        slots[slot] = {position, state};
+        used++;
+    }
+
+    // Drop the dead pairs, and make room for as many live ones again
+    void Rehash() {
+        vector<Slot> live;
+        for (const Slot &slot : slots) {
+            if (slot.position != EMPTY && slot.position >= low) live.push_back(slot);
+        }
+        size_t size = 256;
+        while (size < live.size() * 4) size *= 2;
+        slots.assign(size, Slot());
+        mask = size - 1;
+        used = 0;
+        for (const Slot &slot : live) {
+            Add(slot.state, slot.position);
+        }
+    }
+};
+
+// Record the failed stretch of a scan of dfa (DFA, LazyDFA or StaticLexer):
+// it started at index, had its last accept at from and stopped at end. The
+// scan is walked again from its start, as the state ids it saw may be gone
+// from a LazyDFA's cache. at(k) is the input byte at k.
+template <class Automaton, class ByteAt>
+void RecordFailure(MunchTable &failed, const Automaton &dfa, size_t index, size_t from, size_t end, ByteAt at) {
+    int state = dfa.GetStartState();
+    size_t k = index;
+    failed.Fail(index, from, end, [&](size_t position) {
+        for (; k < position; k++) {
+            state = dfa.Next(state, at(k));
+        }
+        return dfa.StableState(state);
+    });
+}
+
+// Longest match of the combined DFA (DFA or LazyDFA) starting at index. Returns
+// the length of the longest accepted prefix (0 if none) and sets token to the
+// rule it matched. With a failure table, the scan stops at the pairs earlier
+// scans have shown to fail, and records the ones it finds itself. If scanned
+// is given, it is set to the number of bytes the scan read from index, which
+// is more than the match when the scan looked ahead for a longer one.
+template <class Automaton>
+size_t LongestMatch(const Automaton &dfa, string_view input, size_t index, int &token, MunchTable *failed = nullptr,
+                    size_t *scanned = nullptr) {
+    int state = dfa.GetStartState();
+    int dead = dfa.GetDeadState();
+    size_t longestMatchLength = 0;
+    size_t j = index;
+    token = -1;
+    COUNT(restarts++);
+    for (; j < input.length(); j++) {
+        if (failed && failed->Covers(j) && failed->Failed(dfa.StableState(state), j)) break;
+        int prev = state;
+        state = dfa.Next(state, input[j]);
+        if (state == dead) break;
+        COUNT(transitions++);
+        if (state == prev && !(failed && failed->Covers(j + 1))) {
+            // In a self-loop: the state, and so the match, stays the same for the whole run
+            size_t run = dfa.SkipSelfLoop(state, input.data() + j + 1, input.length() - j - 1);
+            COUNT(transitions += run);
+            j += run;
+        }
+        if (dfa.IsFinal(state)) {
+            longestMatchLength = j - index + 1;
+            token = dfa.GetFinalToken(state);
+        }
+    }
+    if (failed && j > index + longestMatchLength) {
+        RecordFailure(*failed, dfa, index, index + longestMatchLength, j, [&](size_t k) { return input[k]; });
+    }
+    if (scanned) *scanned = j - index + (state == dead); // the byte that led to the dead state was read
+    return longestMatchLength;
+}
+
+// Run one token's matcher (DFA or BitMatcher) from index. Returns the length
+// of the longest prefix it accepts, 0 if none. failed is the matcher's own
+// failure table: each token's scans fail on their own.
+template <class Matcher>
+size_t AcceptedLength(Matcher &matcher, string_view input, size_t index, MunchTable *failed = nullptr) {
+    if constexpr (is_same_v<Matcher, DFA>) {
+        int token;
+        return LongestMatch(matcher, input, index, token, failed);
+    } else {
+        matcher.Reset();
+        COUNT(restarts++);
+        size_t j = index;
+        for (; j < input.length(); j++) {
+            if (failed && failed->Covers(j) && failed->Failed(matcher.StableState(), j)) break;
+            if (!matcher.Move(input[j])) break;
+        }
+        size_t length = matcher.GetAccepted() ? matcher.GetAcceptedLength() : 0;
+        if (failed && j > index + length) {
+            matcher.Reset();
+            size_t k = index;
+            failed->Fail(index, index + length, j, [&](size_t position) {
+                for (; k < position; k++) {
+                    matcher.Move(input[k]);
+                }
+                return matcher.StableState();
+            });
+        }
+        return length;
+    }
+}
+
+// Next token at index, which must not be whitespace: the longest match, or a
+// one-byte ERROR token if nothing matches
+Token NextToken(const DFA &dfa, string_view input, size_t index, MunchTable *failed = nullptr) {
+    int token;
+    size_t length = LongestMatch(dfa, input, index, token, failed);
+    return length > 0 ? Token{token, index, length} : Token{-1, index, 1};
+}
+
+// Maximal-munch scan of an in-memory input with a combined DFA (DFA or LazyDFA)
+template <class Automaton>
+void ScanString(const Automaton &dfa, string_view input, TokenWriter &out) {
+    MunchTable failed;
+    size_t index = 0;
+    while (index < input.length()) {
+        index += SkipRun(SPACE_RUN, input.data() + index, input.length() - index);
+        if (index >= input.length()) break;
+
+        int token;
+        size_t length = LongestMatch(dfa, input, index, token, &failed);
+        if (length > 0) {
+            COUNT(CountToken(token));
+        } else {
+            COUNT(errors++);
+            length = 1;
+        }
+        out.Write({token, index, length}, input.data() + index);
+        index += length;
+    }
+    COUNT(bytes = input.length());
+}
+
+// Maximal-munch scan trying each token's matcher (a variant of DFA and
+// BitMatchers) in turn; the first of the longest matches wins. Each matcher
+// has its own MunchTable, so the scan stays linear however far a token's
+// matcher looks past its last accept.
+template <class Matcher>
+void ScanPerToken(vector<Matcher> &matchers, string_view input, TokenWriter &out) {
+    vector<MunchTable> failed(matchers.size());
+    size_t index = 0;
+    while (index < input.length()) {
+        index += SkipRun(SPACE_RUN, input.data() + index, input.length() - index);
+        if (index >= input.length()) break;
+
+        size_t longestMatchLength = 0;
+        int longestMatchIndex = -1;
+        for (size_t i = 0; i < matchers.size(); i++) {
+            TRACE("Testing matcher for token " << i);
+            size_t length = visit([&](auto &matcher) { return AcceptedLength(matcher, input, index, &failed[i]); },
+                                  matchers[i]);
+            if (length > longestMatchLength) {
+                longestMatchLength = length;
+                longestMatchIndex = (int)i;
+                TRACE("Accepted token " << i << " with lexeme: " << input.substr(index, longestMatchLength));
+            }
+        }
+
+        if (longestMatchIndex >= 0) {
+            COUNT(CountToken(longestMatchIndex));
+        } else {
+            COUNT(errors++);
+            longestMatchLength = 1;
+        }
+        out.Write({longestMatchIndex, index, longestMatchLength}, input.data() + index);
+        index += longestMatchLength;
+    }
+    COUNT(bytes = input.length());
+}
+
+// Lex input from begin as if a token started there, keeping the tokens that
+// start before end. The last token may run past end. A speculative scan
+// passes marks: its work is then counted as discarded, and marks gets the
+// work done before each token and at the end, for LexerCounters::Keep().
+void LexChunk(const DFA &dfa, string_view input, size_t begin, size_t end, vector<Token> &out,
+              vector<WorkMark> *marks = nullptr) {
+    MunchTable failed;
+    size_t index = begin;
+    while (index < end) { // a token may end past end
+        index += SkipRun(SPACE_RUN, input.data() + index, end - index);
+        if (index >= end) break;
+        if (marks) COUNT(Mark(*marks));
+        Token token = NextToken(dfa, input, index, &failed);
+        out.push_back(token);
+        index += token.length;
+    }
+    if (marks) {
+        COUNT(Mark(*marks));
+        COUNT(Discard(*marks));
+    }
+}
+
+// Lex an in-memory input on several threads. Each round cuts the next
+// jobs * chunk bytes into chunks and lexes them at the same time, each chunk
+// speculatively from the DFA start state as if a token began at its first
+// byte: this thread takes the first chunk, whose start is a real token start,
+// and jobs - 1 workers, started once for the whole scan, take the others.
+// The rounds are then stitched in order: because the lexer restarts from the
+// start state at every token, a chunk's tokens are exact from the first one
+// that starts where the sequential lexer really starts a token. Tokens before
+// that point are re-lexed from the true position. The output is therefore
+// identical to the sequential token stream.
+//
+// Worst case: the speculative tokens never line up with the real ones, as
+// with t1 a.a over a long run of a's cut at odd offsets, so every chunk is
+// lexed twice. The first chunk that is re-lexed to its end without a resync
+// therefore ends the speculation: the rest of the input is lexed on this
+// thread alone, and at most one round, (jobs - 1) * chunk bytes, is wasted.
+//
+// test_2.txt has tokens that cross small chunks:
+//     mylexer --combined --input test_2.txt --jobs 3 --chunk-size 8 < test_2.txt
+// prints test_2.expected, the same as --jobs 1.
+void ParallelScan(const DFA &dfa, string_view input, TokenWriter &out, int jobs, size_t chunk = 4 << 20) {
+    vector<vector<Token>> chunks(jobs);
+    vector<vector<WorkMark>> marks(jobs); // counted work of each chunk's tokens
+    vector<size_t> begin(jobs + 1);
+
+    mutex lock;
+    condition_variable started, done;
+    uint64_t round = 0; // rounds published so far
+    int busy = 0;       // workers still on the current round
+    bool finished = false;
+    auto worker = [&](int k) {
+        for (uint64_t seen = 0;;) {
+            {
+                unique_lock<mutex> guard(lock);
+                started.wait(guard, [&] { return round != seen || finished; });
+                if (round == seen) break;
+                seen = round;
+            }
+            chunks[k].clear();
+            marks[k].clear();
+            LexChunk(dfa, input, begin[k], begin[k + 1], chunks[k], &marks[k]);
+            lock_guard<mutex> guard(lock);
+            if (--busy == 0) done.notify_one();
+        }
+    };
+    vector<thread> workers;
+    for (int k = 1; k < jobs; k++) {
+        workers.emplace_back(worker, k);
+    }
+
+    MunchTable failed; // for the sequential re-lexing
+    size_t index = 0; // where the sequential lexer resumes
+    bool speculate = true;
+    while (speculate && index < input.size()) {
+        for (int k = 0; k <= jobs; k++) {
+            begin[k] = min(input.size(), index + k * chunk);
+        }
+        {
+            lock_guard<mutex> guard(lock);
+            busy = (int)workers.size();
+            round++;
+        }
+        started.notify_all();
+        chunks[0].clear();
+        marks[0].clear();
+        LexChunk(dfa, input, begin[0], begin[1], chunks[0], &marks[0]);
+        {
+            unique_lock<mutex> guard(lock);
+            done.wait(guard, [&] { return busy == 0; });
+        }
+
+        for (int k = 0; k < jobs; k++) {
+            const vector<Token> &speculative = chunks[k];
+            size_t next = 0; // first speculative token not yet ruled out
+            bool relexed = false;
+            while (index < begin[k + 1]) { // the last token may have run past this chunk
+                index += SkipRun(SPACE_RUN, input.data() + index, begin[k + 1] - index);
+                if (index >= begin[k + 1]) break;
+
+                // Resync: from a common token start on, the speculation is exact
+                while (next < speculative.size() && speculative[next].offset < index) {
+                    next++;
+                }
+                if (next < speculative.size() && speculative[next].offset == index) {
+                    COUNT(Keep(marks[k], next));
+                    for (; next < speculative.size(); next++) {
+                        const Token &token = speculative[next];
+                        if (token.kind >= 0) COUNT(CountToken(token.kind));
+                        else COUNT(errors++);
+                        out.Write(token, input.data() + token.offset);
+                        index = token.offset + token.length;
+                    }
+                    relexed = false;
+                    break;
+                }
+
+                Token token = NextToken(dfa, input, index, &failed);
+                if (token.kind >= 0) COUNT(CountToken(token.kind));
+                else COUNT(errors++);
+                out.Write(token, input.data() + token.offset);
+                index += token.length;
+                relexed = true;
+            }
+            if (relexed) speculate = false; // re-lexed to the end of the chunk
+        }
+    }
+    {
+        lock_guard<mutex> guard(lock);
+        finished = true;
+    }
+    started.notify_all();
+    for (thread &worker : workers) {
+        worker.join();
+    }
+
+    // Without speculation, the rest is lexed in one piece
+    while (index < input.size()) {
+        index += SkipRun(SPACE_RUN, input.data() + index, input.size() - index);
+        if (index >= input.size()) break;
+        Token token = NextToken(dfa, input, index, &failed);
+        if (token.kind >= 0) COUNT(CountToken(token.kind));
+        else COUNT(errors++);
+        out.Write(token, input.data() + token.offset);
+        index += token.length;
+    }
+    COUNT(bytes = input.size());
+}
+
+// Tokens of a text, kept so the text can be re-lexed after edits. Reach(i)
+// is one past the furthest byte the scans of tokens 0 to i read (a scan reads
+// past its token while looking for a longer match), so it never decreases.
+// The tokens live in a gap buffer: those before the gap hold their offset and
+// reach, those after it their distance from the end of the text, which an
+// edit at the gap leaves as it is. So replacing tokens at the gap never
+// touches the tokens after it, and moving the gap costs only the tokens it
+// passes: a run of edits costs the tokens between them, not the whole text.
+class TokenStream {
+public:
+    size_t Size() const {
+        return tokens.size() - (gap_end - gap_start);
+    }
+
+    // Length of the text the tokens were lexed from
+    size_t Length() const {
+        return length;
+    }
+
+    Token Get(size_t i) const {
+        if (i < gap_start) return tokens[i];
+        Token token = tokens[i + gap_end - gap_start];
+        token.offset = length - token.offset;
+        return token;
+    }
+
+    size_t Reach(size_t i) const {
+        return i < gap_start ? reach[i] : length - reach[i + gap_end - gap_start];
+    }
+
+    // Move the gap to just before token i
+    void MoveGap(size_t i) {
+        while (gap_start > i) {
+            gap_start--;
+            gap_end--;
+            tokens[gap_end] = tokens[gap_start];
+            tokens[gap_end].offset = length - tokens[gap_start].offset;
+            reach[gap_end] = length - reach[gap_start];
+        }
+        while (gap_start < i) {
+            tokens[gap_start] = tokens[gap_end];
+            tokens[gap_start].offset = length - tokens[gap_end].offset;
+            reach[gap_start] = length - reach[gap_end];
+            gap_start++;
+            gap_end++;
+        }
+    }
+
+    // Replace the removed tokens after the gap with relexed ones, which end
+    // up before it; the text is now newLength bytes long
+    void Replace(size_t removed, const vector<Token> &relexed, const vector<size_t> &relexedReach, size_t newLength) {
+        gap_end += removed;
+        if (gap_end - gap_start < relexed.size()) {
+            Grow(relexed.size());
+        }
+        copy(relexed.begin(), relexed.end(), tokens.begin() + gap_start);
+        copy(relexedReach.begin(), relexedReach.end(), reach.begin() + gap_start);
+        gap_start += relexed.size();
+        length = newLength;
+    }
+
+    // Raise the reach of the tokens after the gap to at least value; only
+    // those that end before value, all read by the last relexed scan, change
+    void RaiseReach(size_t value) {
+        for (size_t j = gap_end; j < reach.size() && length - reach[j] < value; j++) {
+            reach[j] = length - value;
+        }
+    }
+
+private:
+    vector<Token> tokens; // gap_start tokens, the gap, the tokens after it
+    vector<size_t> reach;
+    size_t gap_start = 0;
+    size_t gap_end = 0;
+    size_t length = 0;
+
+    // Make the gap at least size long, doubling the buffer
+    void Grow(size_t size) {
+        size_t after = tokens.size() - gap_end;
+        size_t capacity = max(2 * tokens.size(), gap_start + size + after);
+        tokens.resize(capacity);
+        reach.resize(capacity);
+        move_backward(tokens.begin() + gap_end, tokens.begin() + gap_end + after, tokens.end());
+        move_backward(reach.begin() + gap_end, reach.begin() + gap_end + after, reach.end());
+        gap_end = capacity - after;
+    }
+};
+
+// Replace deleted bytes at offset with inserted
+struct Edit {
+    size_t offset;
+    size_t deleted;
+    string_view inserted;
+};
+
+// Update stream for edit, where text is the text after the edit. The tokens
+// whose scans read no byte at or after the edit are kept. Lexing restarts at
+// the end of the last of them, and stops at the first token start past the
+// inserted bytes that was also a token start before the edit: every token is
+// lexed from the DFA start state and the text from there on is unchanged, so
+// the old tokens from there on are reused, shifted by the change in length.
+// The lexing work follows the size of the edit, not of the text, and the
+// reused tokens are not rewritten (see TokenStream). Returns the number of
+// bytes re-lexed.
+size_t Relex(const DFA &dfa, string_view text, TokenStream &stream, const Edit &edit) {
+    // First token whose scan read an edited byte, or ran into the end of the old text
+    size_t target = min(edit.offset + 1, stream.Length());
+    size_t first = 0;
+    for (size_t count = stream.Size(); count > 0;) {
+        size_t half = count / 2;
+        if (stream.Reach(first + half) < target) {
+            first += half + 1;
+            count -= half + 1;
+        } else {
+            count = half;
+        }
+    }
+    stream.MoveGap(first);
+    Token before = first > 0 ? stream.Get(first - 1) : Token{-1, 0, 0};
+    size_t begin = before.offset + before.length;
+    size_t reach = first > 0 ? stream.Reach(first - 1) : 0;
+    size_t editEnd = edit.offset + edit.inserted.size();
+
+    vector<Token> relexed;
+    vector<size_t> relexedReach;
+    MunchTable failed; // reach stays a running max, so scans cut short by it need no more
+    size_t next = first; // old tokens before next are replaced
+    size_t index = begin;
+    for (;;) {
+        index += SkipRun(SPACE_RUN, text.data() + index, text.size() - index);
+        if (index >= text.size()) {
+            next = stream.Size();
+            break;
+        }
+        if (index >= editEnd) {
+            // Resync: a token starts here in the old text too
+            size_t old = index - edit.inserted.size() + edit.deleted;
+            while (next < stream.Size() && stream.Get(next).offset < old) {
+                next++;
+            }
+            if (next < stream.Size() && stream.Get(next).offset == old) break;
+        }
+        int token;
+        size_t scanned;
+        size_t length = LongestMatch(dfa, text, index, token, &failed, &scanned);
+        reach = max(reach, index + scanned);
+        relexed.push_back(length > 0 ? Token{token, index, length} : Token{-1, index, 1});
+        relexedReach.push_back(reach);
+        index += relexed.back().length;
+    }
+
+    stream.Replace(next - first, relexed, relexedReach, text.size());
+    stream.RaiseReach(reach);
+    return index - begin;
+}
+
+// Lex all of text into a stream that Relex() can update
+TokenStream LexText(const DFA &dfa, string_view text) {
+    TokenStream stream;
+    Relex(dfa, text, stream, {0, 0, text}); // inserting all of text into an empty one
+    return stream;
+}
+
+// Input for the streaming lexer. A file is memory-mapped and handed out in
+// windows; anything else is read in fixed-size chunks. Offsets are absolute
+// input offsets. Refill() keeps the bytes from a given offset on (the lexeme
+// being scanned) and makes more input available after them, so memory stays
+// at the buffer size no matter how large the input is.
+class InputBuffer {
+public:
+    static constexpr size_t CHUNK_SIZE = 1 << 20;
+    static constexpr size_t MAP_WINDOW = 64 << 20;
+
+    // Read from a stdio stream in chunks
+    explicit InputBuffer(FILE *in) : file(in), storage(CHUNK_SIZE) {
+        data = storage.data();
+    }
+
+    // Map a whole file and make all of it available at once
+    bool MapWhole(const string &path) {
+        if (!Map(path)) return false;
+        end = map_size;
+        eof = true;
+        return true;
+    }
+
+    // Map a whole file; returns false if it can't be opened or mapped
+    bool Map(const string &path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            close(fd);
+            return false;
+        }
+        if (st.st_size > 0) {
+            void *mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped == MAP_FAILED) {
+                close(fd);
+                return false;
+            }
+            madvise(mapped, st.st_size, MADV_SEQUENTIAL);
+            map_base = (const char *)mapped;
+            map_size = st.st_size;
+        }
+        close(fd);
+        file = nullptr;
+        data = map_base;
+        end = min(map_size, MAP_WINDOW);
+        eof = end == map_size;
+        return true;
+    }
+
+    ~InputBuffer() {
+        if (map_base) munmap((void *)map_base, map_size);
+    }
+
+    char At(size_t offset) const { return data[offset - base]; }
+    const char *Ptr(size_t offset) const { return data + (offset - base); }
+
+    // End of the bytes currently buffered
+    size_t End() const { return base + end; }
+
+    // Drop the bytes before keep and read more input after the rest.
+    // Returns false once the input is exhausted.
+    bool Refill(size_t keep) {
+        if (eof) return false;
+        if (map_base) {
+            // Let the kernel drop the pages before the lexeme, then widen the window
+            size_t page = (size_t)sysconf(_SC_PAGESIZE);
+            size_t upto = keep / page * page;
+            if (upto > released) {
+                madvise((void *)(map_base + released), upto - released, MADV_DONTNEED);
+                released = upto;
+            }
+            end = min(map_size, end + MAP_WINDOW);
+            eof = end == map_size;
+            return true;
+        }
+        size_t drop = keep - base;
+        size_t kept = end - drop;
+        memmove(storage.data(), storage.data() + drop, kept);
+        if (kept == storage.size()) {
+            storage.resize(storage.size() * 2); // lexeme longer than the buffer
+        }
+        data = storage.data();
+        base = keep;
+        end = kept;
+        while (end < storage.size()) {
+            size_t n = fread(storage.data() + end, 1, storage.size() - end, file);
+            if (n == 0) {
+                eof = true;
+                break;
+            }
+            end += n;
+        }
+        return end > kept;
+    }
+
+private:
+    FILE *file = nullptr;
+    vector<char> storage;
+    const char *map_base = nullptr;
+    size_t map_size = 0;
+    size_t released = 0;
+    const char *data = nullptr;
+    size_t base = 0; // offset of data[0]
+    size_t end = 0;  // bytes in data
+    bool eof = false;
+};
+
+// Maximal-munch scan of a whole input stream with a combined DFA (DFA or
+// StaticLexer). When a lexeme runs into the end of the buffer, its DFA state
+// and last accepting position are kept and scanning resumes after the refill.
+template <class Automaton>
+void ScanStream(const Automaton &dfa, InputBuffer &input, TokenWriter &out) {
+    MunchTable failed;
+    int dead = dfa.GetDeadState();
+    size_t index = 0;
+    for (;;) {
+        index += SkipRun(SPACE_RUN, input.Ptr(index), input.End() - index);
+        if (index >= input.End()) {
+            if (!input.Refill(index)) break;
+            continue;
+        }
+
+        int state = dfa.GetStartState();
+        int token = -1;
+        size_t longestMatchLength = 0;
+        size_t j = index;
+        COUNT(restarts++);
+        for (;;) {
+            while (j < input.End()) {
+                if (failed.Covers(j) && failed.Failed(dfa.StableState(state), j)) {
+                    state = dead; // as good as dead: no accept is reachable
+                    break;
+                }
+                int prev = state;
+                state = dfa.Next(state, input.At(j));
+                if (state == dead) break;
+                j++;
+                COUNT(transitions++);
+                if (state == prev && !failed.Covers(j)) {
+                    size_t run = dfa.SkipSelfLoop(state, input.Ptr(j), input.End() - j);
+                    COUNT(transitions += run);
+                    j += run;
+                }
+                if (dfa.IsFinal(state)) {
+                    longestMatchLength = j - index;
+                    token = dfa.GetFinalToken(state);
+                }
+            }
+            // Out of buffered input mid-lexeme: keep the lexeme and read more
+            if (state == dead || !input.Refill(index)) break;
+        }
+        if (j > index + longestMatchLength) {
+            RecordFailure(failed, dfa, index, index + longestMatchLength, j, [&](size_t k) { return input.At(k); });
+        }
+
+        if (longestMatchLength > 0) {
+            COUNT(CountToken(token));
+        } else {
+            COUNT(errors++);
+            longestMatchLength = 1;
+        }
+        out.Write({token, index, longestMatchLength}, input.Ptr(index));
+        index += longestMatchLength;
+    }
+    COUNT(bytes = index);
+}
+
+// Lex one record of a batch into out, with token offsets made absolute by
+// start. When counting, the tokens are tallied in counts instead.
+void LexRecord(const DFA &dfa, string_view record, size_t start, const TokenWriter &writer, vector<Token> &found,
+               vector<size_t> &counts, string &out) {
+    found.clear();
+    LexChunk(dfa, record, 0, record.size(), found);
+    out.clear();
+    for (const Token &token : found) {
+        if (token.kind >= 0) COUNT(CountToken(token.kind));
+        else COUNT(errors++);
+        if (writer.Counting()) {
+            counts[token.kind + 1]++;
+        } else {
+            writer.Format(out, {token.kind, start + token.offset, token.length}, record.data() + token.offset);
+        }
+    }
+    if (writer.Text()) out += '\n'; // an empty line ends each record
+    COUNT(bytes += record.size() + 1);
+}
+
+// Batch mode: every line of the input is a separate record, lexed on its own
+// from the start state. Lines are taken from the buffer ROUND at a time, so
+// memory stays bounded however many records there are; the output of each
+// round is written in input order before the next one is read.
+//
+// The records of a round are lexed by jobs threads sharing one frozen DFA:
+// this thread and jobs - 1 workers started once for the whole run. For each
+// round this thread publishes the records and wakes the workers, then
+// everyone takes blocks of BLOCK records from one shared atomic index until
+// none is left. Each record is formatted into its own slot of out, so the
+// output order never depends on which thread lexed what. When counting, each
+// thread tallies on its own and adds its counts to writer at the end.
+void BatchScan(const DFA &dfa, InputBuffer &input, TokenWriter &writer, int jobs) {
+    const size_t ROUND = 1 << 16;
+    const size_t BLOCK = 256;
+    vector<string_view> records;
+    vector<size_t> starts;
+    vector<string> out;
+
+    mutex lock;
+    condition_variable started, done;
+    uint64_t round = 0; // rounds published so far
+    int busy = 0;       // workers still on the current round
+    bool finished = false;
+    atomic<size_t> next{0}; // next block of the current round
+
+    auto lexBlocks = [&](vector<Token> &found, vector<size_t> &counts) {
+        for (size_t block; (block = next.fetch_add(1)) * BLOCK < records.size();) {
+            for (size_t r = block * BLOCK; r < min(records.size(), (block + 1) * BLOCK); r++) {
+                LexRecord(dfa, records[r], starts[r], writer, found, counts, out[r]);
+            }
+        }
+    };
+    auto worker = [&] {
+        vector<Token> found;
+        vector<size_t> counts(writer.Counting() ? writer.NumTokens() + 1 : 0, 0);
+        for (uint64_t seen = 0;;) {
+            {
+                unique_lock<mutex> guard(lock);
+                started.wait(guard, [&] { return round != seen || finished; });
+                if (round == seen) break;
+                seen = round;
+            }
+            lexBlocks(found, counts);
+            lock_guard<mutex> guard(lock);
+            if (--busy == 0) done.notify_one();
+        }
+        lock_guard<mutex> guard(lock);
+        if (writer.Counting()) writer.AddCounts(counts);
+    };
+    vector<thread> workers;
+    for (int k = 1; k < jobs; k++) {
+        workers.emplace_back(worker);
+    }
+
+    vector<Token> found;
+    vector<size_t> counts(writer.Counting() ? writer.NumTokens() + 1 : 0, 0);
+    size_t index = 0;
+    for (;;) {
+        records.clear();
+        starts.clear();
+        while (records.size() < ROUND && index < input.End()) {
+            const char *line = input.Ptr(index);
+            const char *newline = (const char *)memchr(line, '\n', input.End() - index);
+            if (!newline) break;
+            records.emplace_back(line, newline - line);
+            starts.push_back(index);
+            index += newline - line + 1;
+        }
+        if (records.empty()) {
+            // No whole line left in the buffer: read more, or finish with an unterminated last line
+            if (input.Refill(index)) continue;
+            if (index == input.End()) break;
+            records.emplace_back(input.Ptr(index), input.End() - index);
+            starts.push_back(index);
+            index = input.End();
+        }
+        out.resize(records.size());
+        {
+            lock_guard<mutex> guard(lock);
+            next = 0;
+            busy = (int)workers.size();
+            round++;
+        }
+        started.notify_all();
+        lexBlocks(found, counts);
+        {
+            unique_lock<mutex> guard(lock);
+            done.wait(guard, [&] { return busy == 0; });
+        }
+        for (size_t r = 0; r < records.size(); r++) {
+            writer.Write(out[r]);
+        }
+    }
+
+    {
+        lock_guard<mutex> guard(lock);
+        finished = true;
+    }
+    started.notify_all();
+    for (thread &worker : workers) {
+        worker.join();
+    }
+    if (writer.Counting()) writer.AddCounts(counts);
+}
+
+// Build one NFA for all tokens: accept states carry the token index
+NFA BuildCombinedNFA(const vector<pair<string, string>> &tokens) {
+    NFA nfa;
+    vector<Fragment> fragments;
+    for (const auto &token : tokens) {
+        string postfix = InfixToPostfix(token.second);
+        TRACE("Infix: " << token.second << " -> Postfix: " << postfix);
+        fragments.push_back(PostfixToNFA(postfix, nfa));
+    }
+    CombineNFAs(nfa, fragments);
+    return nfa;
+}
+
+// Build one DFA for all tokens: accept states carry the token index
+DFA BuildCombinedDFA(const vector<pair<string, string>> &tokens, bool minimize) {
+    return MaybeMinimize(NFAtoDFA(BuildCombinedNFA(tokens)), minimize);
+}
+
+// C++ character literal for a byte in a case label
+string CharLiteral(int c) {
+    if (c == '\'' || c == '\\') return string("'\\") + (char)c + "'";
+    if (isprint(c)) return string("'") + (char)c + "'";
+    return to_string(c);
+}
+
+// Emit a standalone direct-coded scanner for the combined DFA. Every DFA
+// state becomes a label: entering it through a transition records the match
+// if the state is final, then a switch on the next byte jumps straight to
+// the target state. The token enum, the longest-match loop and a main()
+// that lexes stdin come with it; define LEXER_NO_MAIN to build it into
+// another program and call Scan() directly.
+void EmitCpp(const DFA &dfa, const vector<pair<string, string>> &tokens, const string &spec, ostream &out) {
+    // Names that map to the same identifier (a-b and a_b) get the token index
+    vector<string> enumNames;
+    set<string> used = {"TOK_ERROR"};
+    for (const auto &token : tokens) {
+        string name = "TOK_";
+        for (char c : token.first) name += isalnum((unsigned char)c) ? c : '_';
+        while (!used.insert(name).second) name += "_" + to_string(enumNames.size());
+        enumNames.push_back(name);
+    }
+    vector<vector<int>> classBytes(dfa.GetNumClasses());
+    for (int c = 0; c < 256; c++) {
+        classBytes[dfa.GetByteClass((char)c)].push_back(c);
+    }
+
+    out << "// Generated by mylexer --emit-cpp from the token spec:\n"
+        << "//   " << spec << "\n"
+        << "#include <cctype>\n#include <cstddef>\n#include <cstdio>\n#include <string>\n\n";
+    out << "enum TokenKind {\n    TOK_ERROR = -1,\n";
+    for (size_t i = 0; i < enumNames.size(); i++) {
+        out << "    " << enumNames[i] << " = " << i << ",\n";
+    }
+    out << "};\n\nstatic const char *const kTokenNames[] = {";
+    for (size_t i = 0; i < tokens.size(); i++) {
+        out << (i ? ", " : "") << "\"";
+        for (char c : tokens[i].first) out << (c == '"' || c == '\\' ? "\\" : "") << c;
+        out << "\"";
+    }
+    out << "};\n\n";
+
+    out << "// Longest match starting at p; returns its length (0 if none) and the token kind\n"
+        << "static size_t Scan(const char *p, const char *end, int &kind) {\n"
+        << "    const char *q = p;\n"
+        << "    size_t length = 0;\n"
+        << "    kind = TOK_ERROR;\n"
+        << "    goto L" << dfa.GetStartState() << ";\n";
+    // Only emit the labels something jumps to
+    vector<bool> targeted(dfa.GetNumStates(), false);
+    for (int state = 0; state < dfa.GetNumStates(); state++) {
+        for (int a = 0; a < dfa.GetNumClasses(); a++) {
+            int target = dfa.NextClass(state, a);
+            if (target != dfa.GetDeadState()) targeted[target] = true;
+        }
+    }
+    for (int state = 0; state < dfa.GetNumStates(); state++) {
+        if (targeted[state]) {
+            out << "S" << state << ":\n";
+            if (dfa.IsFinal(state)) {
+                out << "    length = q - p;\n"
+                    << "    kind = " << enumNames[max(dfa.GetFinalToken(state), 0)] << ";\n";
+            }
+        }
+        if (state == dfa.GetStartState()) {
+            out << "L" << state << ":\n";
+        }
+        out << "    if (q == end) return length;\n"
+            << "    switch ((unsigned char)*q++) {\n";
+        for (int a = 0; a < dfa.GetNumClasses(); a++) {
+            int target = dfa.NextClass(state, a);
+            if (target == dfa.GetDeadState()) continue;
+            out << "    ";
+            for (int c : classBytes[a]) {
+                out << "case " << CharLiteral(c) << ": ";
+            }
+            out << "goto S" << target << ";\n";
+        }
+        out << "    default: return length;\n"
+            << "    }\n";
+    }
+    out << "}\n\n";
+
+    out << "#ifndef LEXER_NO_MAIN\n"
+        << "int main() {\n"
+        << "    std::string input;\n"
+        << "    char buffer[1 << 16];\n"
+        << "    size_t n;\n"
+        << "    while ((n = fread(buffer, 1, sizeof(buffer), stdin)) > 0) input.append(buffer, n);\n"
+        << "    const char *p = input.data();\n"
+        << "    const char *end = p + input.size();\n"
+        << "    while (p < end) {\n"
+        << "        if (isspace((unsigned char)*p)) {\n"
+        << "            p++;\n"
+        << "            continue;\n"
+        << "        }\n"
+        << "        int kind;\n"
+        << "        size_t length = Scan(p, end, kind);\n"
+        << "        if (length == 0) length = 1;\n"
+        << "        printf(\"%s , \\\"%.*s\\\"\\n\", kind < 0 ? \"ERROR\" : kTokenNames[kind], (int)length, p);\n"
+        << "        p += length;\n"
+        << "    }\n"
+        << "    return 0;\n"
+        << "}\n"
+        << "#endif\n";
+}
+
+// 64-bit FNV-1a hash of a spec line, used as the cache key
+uint64_t HashSpec(const string &spec) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : spec) {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Load the combined DFA for a spec line from the cache directory, or build
+// it and store it there. Minimized and unminimized tables are cached apart.
+DFA LoadOrBuildCombinedDFA(const string &specLine, const vector<pair<string, string>> &tokens,
+                           bool minimize, const string &cacheDir) {
+    if (cacheDir.empty()) {
+        return BuildCombinedDFA(tokens, minimize);
+    }
+    string key = specLine + (minimize ? "\n#minimized" : "");
+    uint64_t hash = HashSpec(key);
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.dfa", (unsigned long long)hash);
+    string path = cacheDir + "/" + name;
+
+    DFA dfa({0}, {});
+    if (dfa.LoadTable(path, key, hash, (int)tokens.size())) {
+        TRACE("Loaded DFA from cache " << path);
+        return dfa;
+    }
+    dfa = BuildCombinedDFA(tokens, minimize);
+    if ((mkdir(cacheDir.c_str(), 0755) != 0 && errno != EEXIST) || !dfa.SaveTable(path, key, hash)) {
+        cerr << "Cannot write DFA cache " << path << endl;
+    }
+    return dfa;
+}
+
+// Main lexer function
+//   --combined      build one DFA for all tokens instead of one DFA per token
+//   --minimize      minimize each DFA after subset construction
+//   --stream        lex the rest of stdin (unquoted) in fixed-size chunks
+//   --input <file>  lex a memory-mapped file (unquoted) instead of line 2
+//   --cache-dir <d> load the combined DFA from (or save it to) a cache file
+//                   keyed by a hash of the spec line
+//   --emit-cpp <f>  write a direct-coded C++ scanner for the spec and exit
+//   --builtin       lex all of stdin (unquoted, no spec line) with the token
+//                   set compiled into the binary
+//   --jobs <n>      with --input, lex the file on n threads
+//   --chunk-size <b> bytes each thread lexes at a time with --jobs (default
+//                   4M)
+//   --batch         lex every line of the rest of stdin (or of the --input
+//                   file) as a separate record, on --jobs threads (default
+//                   one per core); each record's tokens end with an empty line
+//   --lazy          build combined DFA states while scanning instead of up front
+//   --lazy-cache <n> keep at most n lazily built states (default 10000)
+//   --engine <kind> per-token matcher: dfa, bits (Glushkov bitmasks, up to
+//                   127 operands) or auto (bits when they fit in one word);
+//                   <token>=<kind> sets it for one token. Default dfa;
+//                   the bitmask engines only pay off for long regexes that
+//                   blow up as a DFA.
+//   --edit <offset>:<deleted>:<text>
+//                   after lexing the input string, replace deleted bytes at
+//                   offset with text and re-lex only around the edit; may be
+//                   repeated, each edit applying to the result of the last.
+//                   Prints the final tokens, and the bytes re-lexed to stderr.
+//   --format <f>    token output: text (NAME , "lexeme"), csv, binary
+//                   (BinaryToken records) or count (tokens of each kind only).
+//                   Default text.
+// Both streaming modes use the combined DFA.
+int main(int argc, char *argv[]) {
+    bool combined = false;
+    bool minimize = false;
+    bool stream = false;
+    string inputFile;
+    string cacheDir;
+    string emitFile;
+    bool builtin = false;
+    int jobs = 0; // 0: one per core in batch mode, one otherwise
+    size_t chunkSize = 4 << 20;
+    bool batch = false;
+    bool lazy = false;
+    size_t lazyStates = 10000;
+    string engine = "dfa";
+    map<string, string> tokenEngines; // token name -> engine
+    vector<pair<pair<size_t, size_t>, string>> edits; // (offset, deleted), inserted text
+    OutputFormat format = OutputFormat::TEXT;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--combined") {
+            combined = true;
+        } else if (arg == "--minimize") {
+            minimize = true;
+        } else if (arg == "--no-minimize") {
+            minimize = false;
+        } else if (arg == "--stream") {
+            stream = true;
+        } else if (arg == "--input" && i + 1 < argc) {
+            inputFile = argv[++i];
+        } else if (arg == "--cache-dir" && i + 1 < argc) {
+            cacheDir = argv[++i];
+        } else if (arg == "--emit-cpp" && i + 1 < argc) {
+            emitFile = argv[++i];
+        } else if (arg == "--builtin") {
+            builtin = true;
+        } else if (arg == "--jobs" && i + 1 < argc) {
+            jobs = max(1, atoi(argv[++i]));
+        } else if (arg == "--chunk-size" && i + 1 < argc) {
+            chunkSize = max(1UL, strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--batch") {
+            batch = true;
+        } else if (arg == "--lazy") {
+            lazy = true;
+        } else if (arg == "--lazy-cache" && i + 1 < argc) {
+            lazyStates = strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--engine" && i + 1 < argc) {
+            string value = argv[++i];
+            size_t equals = value.find('=');
+            string kind = equals == string::npos ? value : value.substr(equals + 1);
+            if (kind != "dfa" && kind != "bits" && kind != "auto") {
+                cerr << "Unknown engine " << kind << endl;
+                return 1;
+            }
+            if (equals == string::npos) {
+                engine = kind;
+            } else {
+                tokenEngines[value.substr(0, equals)] = kind;
+            }
+        } else if (arg == "--format" && i + 1 < argc) {
+            string value = argv[++i];
+            if (!ParseOutputFormat(value, format)) {
+                cerr << "Unknown format " << value << endl;
+                return 1;
+            }
+        } else if (arg == "--edit" && i + 1 < argc) {
+            string value = argv[++i];
+            size_t colon1 = value.find(':');
+            size_t colon2 = colon1 == string::npos ? string::npos : value.find(':', colon1 + 1);
+            if (colon2 == string::npos) {
+                cerr << "Bad edit " << value << ", expected <offset>:<deleted>:<text>" << endl;
+                return 1;
+            }
+            edits.push_back({{strtoul(value.c_str(), nullptr, 10), strtoul(value.c_str() + colon1 + 1, nullptr, 10)},
+                             value.substr(colon2 + 1)});
+        } else {
+            cerr << "Usage: " << argv[0] << " [--combined] [--[no-]minimize] [--stream | --input <file>]"
+                 << " [--cache-dir <dir>] [--emit-cpp <file>] [--builtin] [--jobs <n> [--chunk-size <bytes>]] [--batch]"
+                 << " [--lazy [--lazy-cache <n>]] [--engine [<token>=]dfa|bits|auto]"
+                 << " [--edit <offset>:<deleted>:<text>]... [--format text|csv|binary|count]" << endl;
+            return 1;
+        }
+    }
+
+    // Built-in token set: the tables were computed by the compiler
+    if (builtin) {
+        vector<pair<string, string>> tokens;
+        for (int i = 0; i < kBuiltinLexer.num_tokens; i++) {
+            tokens.push_back({string(kBuiltinLexer.GetTokenName(i)), ""});
+        }
+        COUNT(SetTokenNames(tokens));
+        InputBuffer input(stdin);
+        TokenWriter out(tokens, format);
+        out.Begin();
+        COUNT(StartScan());
+        ScanStream(kBuiltinLexer, input, out);
+        out.Finish();
+        COUNT(StopScan());
+        return 0;
+    }
+
+    // Read input from stdin
+    string line;
+    getline(cin, line);
+    string specLine = line;
+
+    // Parse token definitions
+    vector<pair<string, string>> tokens;
+    vector<string> tokenDefs = SplitAndTrim(line, ',');
+    for (const string& tokenDef : tokenDefs) {
+        size_t spacePos = tokenDef.find(' ');
+        if (spacePos != string::npos) {
+            string tokenName = tokenDef.substr(0, spacePos);
+            string tokenRegex = tokenDef.substr(spacePos + 1);
+            tokens.push_back({tokenName, tokenRegex});
+        }
+    }
+    
+    // Remove the trailing '#' from the last token's regular expression
+    if (!tokens.empty()) {
+        string& lastTokenRegex = tokens.back().second;
+        if (!lastTokenRegex.empty() && lastTokenRegex.back() == '#') {
+            lastTokenRegex.pop_back();
+            lastTokenRegex = TrimDefinition(lastTokenRegex);
+        }
+    }
+
+    // Reject malformed regexes before any matcher is built from them
+    for (const auto &token : tokens) {
+        try {
+            PostfixToNFA(InfixToPostfix(token.second));
+        } catch (const invalid_argument &e) {
+            cerr << "Token " << token.first << ": " << e.what() << endl;
+            return 1;
+        }
+    }
+
+    COUNT(SetTokenNames(tokens));
+
+#ifdef LEXER_TRACE
+    // Debug: Print parsed token definitions
+    TRACE("Parsed Token Definitions:");
+    for (const auto &token : tokens) {
+        TRACE("Token Name: " << token.first << ", Regex: " << token.second);
+    }
+#endif
+
+    if (!emitFile.empty()) {
+        DFA dfa = LoadOrBuildCombinedDFA(specLine, tokens, minimize, cacheDir);
+        ofstream out(emitFile);
+        EmitCpp(dfa, tokens, specLine, out);
+        if (!out) {
+            cerr << "Cannot write " << emitFile << endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    if (batch) {
+        InputBuffer input(stdin);
+        if (!inputFile.empty() && !input.Map(inputFile)) {
+            cerr << "Cannot map " << inputFile << endl;
+            return 1;
+        }
+        DFA dfa = LoadOrBuildCombinedDFA(specLine, tokens, minimize, cacheDir);
+        TokenWriter out(tokens, format);
+        out.Begin();
+        COUNT(StartScan());
+        BatchScan(dfa, input, out, jobs > 0 ? jobs : max(1, (int)thread::hardware_concurrency()));
+        out.Finish();
+        COUNT(StopScan());
+        return 0;
+    }
+
+    if (!inputFile.empty() && jobs > 1 && !lazy) {
+        InputBuffer input(stdin);
+        if (!input.MapWhole(inputFile)) {
+            cerr << "Cannot map " << inputFile << endl;
+            return 1;
+        }
+        DFA dfa = LoadOrBuildCombinedDFA(specLine, tokens, minimize, cacheDir);
+        TokenWriter out(tokens, format);
+        out.Begin();
+        COUNT(StartScan());
+        ParallelScan(dfa, string_view(input.Ptr(0), input.End()), out, jobs, chunkSize);
+        out.Finish();
+        COUNT(StopScan());
+        return 0;
+    }
+
+    if (stream || !inputFile.empty()) {
+        InputBuffer input(stdin);
+        if (!inputFile.empty() && !input.Map(inputFile)) {
+            cerr << "Cannot map " << inputFile << endl;
+            return 1;
+        }
+        if (lazy) {
+            NFA nfa = BuildCombinedNFA(tokens);
+            LazyDFA dfa(nfa, lazyStates);
+            TokenWriter out(tokens, format);
+            out.Begin();
+            COUNT(StartScan());
+            ScanStream(dfa, input, out);
+            out.Finish();
+            COUNT(StopScan());
+            dfa.Report(cerr);
+            return 0;
+        }
+        DFA dfa = LoadOrBuildCombinedDFA(specLine, tokens, minimize, cacheDir);
+        TokenWriter out(tokens, format);
+        out.Begin();
+        COUNT(StartScan());
+        ScanStream(dfa, input, out);
+        out.Finish();
+        COUNT(StopScan());
+        return 0;
+    }
+
+    // Read input string
+    getline(cin, line);
+    string inputString = Trim(line);
+    inputString = inputString.substr(1, inputString.size() - 2); // Remove surrounding quotes
+
+    // Lex once, then re-lex after each edit
+    if (!edits.empty()) {
+        DFA dfa = LoadOrBuildCombinedDFA(specLine, tokens, minimize, cacheDir);
+        TokenStream stream = LexText(dfa, inputString);
+        for (const auto &edit : edits) {
+            size_t offset = edit.first.first, deleted = edit.first.second;
+            if (offset > inputString.size() || deleted > inputString.size() - offset) {
+                cerr << "Edit at " << offset << " deleting " << deleted << " is outside the input" << endl;
+                return 1;
+            }
+            inputString.replace(offset, deleted, edit.second);
+            size_t relexed = Relex(dfa, inputString, stream, {offset, deleted, edit.second});
+            cerr << "Re-lexed " << relexed << " of " << inputString.size() << " bytes" << endl;
+        }
+        TokenWriter out(tokens, format);
+        out.Begin();
+        for (size_t i = 0; i < stream.Size(); i++) {
+            Token token = stream.Get(i);
+            out.Write(token, inputString.data() + token.offset);
+        }
+        out.Finish();
+        return 0;
+    }
+
+    if (lazy) {
+        NFA nfa = BuildCombinedNFA(tokens);
+        LazyDFA dfa(nfa, lazyStates);
+        TokenWriter out(tokens, format);
+        out.Begin();
+        COUNT(StartScan());
+        ScanString(dfa, inputString, out);
+        out.Finish();
+        COUNT(StopScan());
+        dfa.Report(cerr);
+        return 0;
+    }
+
+    // Single DFA for all tokens: accept states carry the token index
+    if (combined) {
+        DFA dfa = LoadOrBuildCombinedDFA(specLine, tokens, minimize, cacheDir);
+
+        TokenWriter out(tokens, format);
+        out.Begin();
+        COUNT(StartScan());
+        ScanString(dfa, inputString, out);
+        out.Finish();
+        COUNT(StopScan());
+        return 0;
+    }
+
+    // Convert token definitions to matchers: an NFA and then a DFA, or a
+    // bit-parallel Glushkov automaton when --engine asks for one and the
+    // token's positions fit (one word for auto, up to two for bits)
+    vector<variant<DFA, BitMatcher<1>, BitMatcher<2>>> matchers;
+    for (const auto &token : tokens) {
+        string postfix = InfixToPostfix(token.second);
+        // Debug: Print postfix expression
+        TRACE("Infix: " << token.second << " -> Postfix: " << postfix);
+
+        auto override = tokenEngines.find(token.first);
+        string kind = override == tokenEngines.end() ? engine : override->second;
+        int positions = BitMatcher<1>::CountPositions(postfix);
+        if (kind != "dfa" && positions <= BitMatcher<1>::MAX_POSITIONS) {
+            matchers.emplace_back(in_place_type<BitMatcher<1>>, postfix);
+        } else if (kind == "bits" && positions <= BitMatcher<2>::MAX_POSITIONS) {
+            matchers.emplace_back(in_place_type<BitMatcher<2>>, postfix);
+        } else {
+            if (kind == "bits") {
+                cerr << "Token " << token.first << " has " << positions << " positions, using a DFA" << endl;
+            }
+            NFA nfa = PostfixToNFA(postfix);
+            matchers.emplace_back(in_place_type<DFA>, MaybeMinimize(NFAtoDFA(nfa), minimize));
+        }
+    }
+
+    // Perform lexical analysis
+    TokenWriter out(tokens, format);
+    out.Begin();
+    COUNT(StartScan());
+    ScanPerToken(matchers, inputString, out);
+    out.Finish();
+    COUNT(StopScan());
+
     return 0;
 }
@@ -1,6 +1,10 @@
 #include <iostream>
 #include <string>
 #include <unordered_set>
+#include <cerrno>
+#include <cstdio>
+#include <unistd.h>
+#include "TokenFormat.h"
 using namespace std;
 
 //--------------------------------------------------------------
@@ -23,10 +27,11 @@ const string tokenNames[] = { "ID", "NUM", "OP", "KEYWORD", "EOS", "INVALID" };
 class Token
 {
 public:
-    Token(TokenType t, string v) : type(t), value(v) {};
-    Token() : type(EOS), value("") {};
+    Token(TokenType t, string v, size_t o = 0) : type(t), value(v), offset(o) {};
+    Token() : type(EOS), value(""), offset(0) {};
     TokenType type;
     string value;
+    size_t offset; // of the token in the input
 };
 
 //--------------------------------------------------------------
@@ -97,6 +102,7 @@ Token Lexer::getToken()
 
     //---- get next character from input
     char nextChar = input[pos];
+    size_t start = pos;
 
     // Check for identifiers or keywords
     if (isalpha(nextChar))
@@ -106,11 +112,11 @@ Token Lexer::getToken()
             value += input[pos++];
 
         if (isKeyword(value))
-            return Token(KEYWORD, value);
+            return Token(KEYWORD, value, start);
         else if (isIdentifier(value))
-            return Token(ID, value);
+            return Token(ID, value, start);
         else
-            return Token(INVALID, value);
+            return Token(INVALID, value, start);
     }
     // Check for numbers
     else if (isdigit(nextChar))
@@ -120,32 +126,130 @@ Token Lexer::getToken()
             value += input[pos++];
 
         if (isNumber(value))
-            return Token(NUM, value);
+            return Token(NUM, value, start);
         else
-            return Token(INVALID, value);
+            return Token(INVALID, value, start);
     }
     // Check for operators
     else if (nextChar == '+' || nextChar == '-' || nextChar == '*' || nextChar == '/' || nextChar == '=')
     {
-        return Token(OP, string(1, input[pos++]));
+        return Token(OP, string(1, input[pos++]), start);
     }
     // Invalid token
     else
     {
-        return Token(INVALID, string(1, input[pos++]));
+        return Token(INVALID, string(1, input[pos++]), start);
     }
 }
 
+//--------------------------------------------------------------
+// class TokenWriter
+// Formats tokens in one of the OutputFormats of TokenFormat.h, the
+// same CSV, BINARY and COUNT output as mylexer's; TEXT is
+// "Type: <type>\t Value: <value>" per token. Tokens go into one
+// large buffer that goes to stdout in a single write() whenever it
+// fills, instead of an endl flush per token
+//--------------------------------------------------------------
+class TokenWriter
+{
+public:
+    TokenWriter(OutputFormat f) : format(f), counts() {
+        buffer.reserve(BUFFER_SIZE + 4096);
+        if (format == OutputFormat::CSV)
+            buffer += CSV_HEADER;
+    }
+    void write(const Token& token);
+    void finish();
+private:
+    static const size_t BUFFER_SIZE = 1 << 20;
+    OutputFormat format;
+    size_t counts[INVALID + 1];
+    string buffer;
+
+    void flush();
+};
+
+//--------------------------------------------------------------
+// add a token to the output
+//--------------------------------------------------------------
+void TokenWriter::write(const Token& token)
+{
+    switch (format)
+    {
+    case OutputFormat::TEXT:
+        buffer += "Type: " + tokenNames[token.type] + "\t Value: " + token.value + "\n";
+        break;
+    case OutputFormat::CSV:
+        AppendCsvRow(buffer, tokenNames[token.type], token.offset, token.value);
+        break;
+    case OutputFormat::BINARY:
+        AppendBinary(buffer, token.type, token.offset, token.value.size());
+        break;
+    case OutputFormat::COUNT:
+        counts[token.type]++;
+        break;
+    }
+    if (buffer.size() >= BUFFER_SIZE)
+        flush();
+}
+
+//--------------------------------------------------------------
+// write the counts (COUNT format) and anything still buffered
+//--------------------------------------------------------------
+void TokenWriter::finish()
+{
+    if (format == OutputFormat::COUNT)
+    {
+        for (int type = ID; type <= INVALID; type++)
+            if (type != EOS)
+                AppendCount(buffer, tokenNames[type], counts[type]);
+    }
+    flush();
+}
+
+//--------------------------------------------------------------
+// write the buffer to stdout
+//--------------------------------------------------------------
+void TokenWriter::flush()
+{
+    size_t done = 0;
+    while (done < buffer.size())
+    {
+        ssize_t written = ::write(STDOUT_FILENO, buffer.data() + done, buffer.size() - done);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("write");
+            break;
+        }
+        done += written;
+    }
+    buffer.clear();
+}
+
 //--------------------------------------------------------------
 // main
 //--------------------------------------------------------------
-int main()
+// usage: simple_lexer [--format text|csv|binary|count]
+//--------------------------------------------------------------
+int main(int argc, char* argv[])
 {
+    OutputFormat format = OutputFormat::TEXT;
+    string name = argc == 3 && string(argv[1]) == "--format" ? argv[2] : argc == 1 ? "text" : "";
+    if (!ParseOutputFormat(name, format))
+    {
+        cerr << "Usage: " << argv[0] << " [--format text|csv|binary|count]" << endl;
+        return 1;
+    }
+
     string input;
     getline(cin, input);
     Lexer lexer(input);
+    TokenWriter writer(format);
     Token token;
     while ((token = lexer.getToken()).type != EOS)
-        cout << "Type: " << tokenNames[token.type] << "\t Value: " << token.value << endl;
+        writer.write(token);
+    writer.finish();
     return 0;
 }